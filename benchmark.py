@@ -1,35 +1,473 @@
 #!/usr/bin/python3
+import argparse
 import ctypes
-import os
+import csv
 import datetime
+import json
+import math
+import os
+import statistics
+import subprocess
+import sys
 
 
 class cBenchResult(ctypes.Structure):
     '''
-    This has to match the returned struct in library.c
+    This has to match the returned struct in src/bench.h
     '''
     _fields_ = [ ("time", ctypes.c_float),
                   ("num_items", ctypes.c_int),
                    ("num_CASSuc", ctypes.c_int),
                    ("num_CASFail", ctypes.c_int),
-                    ("num_Steal", ctypes.c_int) ]
+                    ("num_Steal", ctypes.c_int),
+                    ("max_list_length", ctypes.c_int),
+                    ("bytes_per_item", ctypes.c_float),
+                    ("dtlb_misses", ctypes.c_long),
+                    ("cache_misses", ctypes.c_long),
+                    ("cpu_ns", ctypes.c_long),
+                    ("num_removed", ctypes.c_long),
+                    ("num_null", ctypes.c_long),
+                    ("empty_ns", ctypes.c_long),
+                    ("remove_jain", ctypes.c_double),
+                    ("remove_max_min", ctypes.c_double),
+                    ("max_gap_ns", ctypes.c_long) ]
+
+class cTrimResult(ctypes.Structure):
+    '''
+    This has to match struct trim_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("rss_start_kb", ctypes.c_long),
+                 ("rss_peak_kb", ctypes.c_long),
+                 ("rss_drained_kb", ctypes.c_long),
+                 ("rss_trimmed_kb", ctypes.c_long) ]
+
+class cOversubResult(ctypes.Structure):
+    '''
+    This has to match struct oversub_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("num_null", ctypes.c_long),
+                 ("num_false_empty", ctypes.c_long),
+                 ("p50_ns", ctypes.c_long),
+                 ("p99_ns", ctypes.c_long),
+                 ("p999_ns", ctypes.c_long) ]
+
+# MAX_NR_THREADS in src/config.h
+MAX_NR_THREADS = 256
+
+def write_oversubscription_data(binary, elements, repetitions, basedir, name):
+    '''
+    Runs the mixed workload with 1x, 2x and 4x as many threads as cores,
+    once backing off and once yielding in the empty path, and writes one
+    line per run.
+    '''
+    cores = os.cpu_count()
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x factor yield run num_elems time throughput num_null false_empty p50_ns p99_ns p999_ns\n")
+        for factor in (1, 2, 4):
+            x = min(factor * cores, MAX_NR_THREADS)
+            for yield_on_empty in (0, 1):
+                binary.SetYieldOnEmpty(yield_on_empty)
+                for run in range(repetitions):
+                    r = binary.benchmark_oversubscribed(x, elements)
+                    datafile.write(f"{x} {factor} {yield_on_empty} {run} {r.num_items} {r.time*1000} "
+                                   f"{r.num_items/r.time} {r.num_null} {r.num_false_empty} "
+                                   f"{r.p50_ns} {r.p99_ns} {r.p999_ns}\n")
+        binary.SetYieldOnEmpty(0)
+
+class cEventfdResult(ctypes.Structure):
+    '''
+    This has to match struct eventfd_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("num_writes", ctypes.c_long),
+                 ("num_reads", ctypes.c_long),
+                 ("num_wakeups", ctypes.c_long),
+                 ("num_late_wakeups", ctypes.c_long),
+                 ("num_lost", ctypes.c_long) ]
+
+def write_eventfd_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Runs one epoll consumer against steady (burst 1) and bursty producers
+    and writes the readiness fd syscalls per item of every run.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x burst run num_elems time writes reads wakeups late_wakeups syscalls_per_item lost\n")
+        for x in xrange:
+            for burst in (1, 64):
+                for run in range(repetitions):
+                    r = binary.benchmark_eventfd(x, elements, burst)
+                    syscalls = r.num_writes + r.num_reads + r.num_wakeups
+                    datafile.write(f"{x} {burst} {run} {r.num_items} {r.time*1000} "
+                                   f"{r.num_writes} {r.num_reads} {r.num_wakeups} "
+                                   f"{r.num_late_wakeups} {syscalls/r.num_items} "
+                                   f"{r.num_lost}\n")
+
+class cSharedResult(ctypes.Structure):
+    '''
+    This has to match struct shared_result in src/sharedBag.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("pipe_time", ctypes.c_float),
+                 ("num_lost", ctypes.c_long),
+                 ("num_duplicated", ctypes.c_long),
+                 ("num_empty", ctypes.c_long) ]
+
+def write_shared_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Passes items between processes through the shared-memory bag and
+    through a pipe, and writes the throughput of both per run.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x run num_elems time throughput pipe_time pipe_throughput lost duplicated empty\n")
+        for x in xrange:
+            for run in range(repetitions):
+                r = binary.benchmark_shared(x, elements)
+                if r.time < 0:
+                    print(f"benchmark_shared failed with {x} processes", file=sys.stderr)
+                    continue
+                datafile.write(f"{x} {run} {r.num_items} {r.time*1000} {r.num_items/r.time} "
+                               f"{r.pipe_time*1000} {r.num_items/r.pipe_time} "
+                               f"{r.num_lost} {r.num_duplicated} {r.num_empty}\n")
+
+class cSharingResult(ctypes.Structure):
+    '''
+    This has to match struct sharing_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("num_steal", ctypes.c_long),
+                 ("num_steal_hits", ctypes.c_long),
+                 ("num_shared", ctypes.c_long),
+                 ("p50_ns", ctypes.c_long),
+                 ("p99_ns", ctypes.c_long),
+                 ("p999_ns", ctypes.c_long) ]
+
+def write_sharing_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Runs the one-producer and the skewed producer workload with stealing
+    only and with work sharing, and writes steal counts and item latency
+    of every run.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x skewed threshold run num_elems time steals steal_hits shared p50_ns p99_ns p999_ns\n")
+        for x in xrange:
+            for skewed in (0, 1):
+                for threshold in (0, 4):
+                    binary.SetWorkSharing(threshold)
+                    for run in range(repetitions):
+                        r = binary.benchmark_sharing(x, elements, skewed)
+                        datafile.write(f"{x} {skewed} {threshold} {run} {r.num_items} {r.time*1000} "
+                                       f"{r.num_steal} {r.num_steal_hits} {r.num_shared} "
+                                       f"{r.p50_ns} {r.p99_ns} {r.p999_ns}\n")
+        binary.SetWorkSharing(0)
+
+class cElimResult(ctypes.Structure):
+    '''
+    This has to match struct elim_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("num_eliminated", ctypes.c_long),
+                 ("num_steal", ctypes.c_long),
+                 ("num_null", ctypes.c_long) ]
+
+def write_elimination_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Runs the balanced add/remove mix without elimination and with a few
+    slot counts, and writes throughput, hand-overs and steals per run.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x slots run num_elems time throughput eliminated steals null\n")
+        for x in xrange:
+            for slots in (0, max(1, x // 4), x):
+                binary.SetElimination(slots)
+                for run in range(repetitions):
+                    r = binary.benchmark_elimination(x, elements)
+                    datafile.write(f"{x} {slots} {run} {r.num_items} {r.time*1000} "
+                                   f"{r.num_items/r.time} {r.num_eliminated} "
+                                   f"{r.num_steal} {r.num_null}\n")
+        binary.SetElimination(0)
+
+class cCompactResult(ctypes.Structure):
+    '''
+    This has to match struct compact_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("blocks_before", ctypes.c_long),
+                 ("blocks_after", ctypes.c_long),
+                 ("compact_ns", ctypes.c_long),
+                 ("steal_ns", ctypes.c_long) ]
+
+def write_compaction_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Drains lists of sparse blocks by stealing, without and after compaction,
+    and writes the list lengths, the compaction time and the steal time.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x compact run num_elems time blocks_before blocks_after "
+                       "compact_ns steal_ns\n")
+        for x in xrange:
+            for compact in (0, 1):
+                for run in range(repetitions):
+                    r = binary.benchmark_compaction(x, elements, compact)
+                    datafile.write(f"{x} {compact} {run} {r.num_items} "
+                                   f"{r.time*1000} {r.blocks_before} "
+                                   f"{r.blocks_after} {r.compact_ns} "
+                                   f"{r.steal_ns}\n")
+
+def write_domain_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Runs the one producer and the empty poll workloads with the summary on
+    and steal domains of 8 threads, of the last level cache and of 64
+    threads (the widest), and writes time, throughput and steals per run.
+    '''
+    workloads = [("one_producer", binary.benchmark_one_producer),
+                 ("empty_poll", binary.benchmark_empty_poll)]
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x domain workload run num_elems time throughput steals\n")
+        binary.SetSummary(1)
+        for x in xrange:
+            for domain in (8, 0, 64):
+                binary.SetStealDomains(domain)
+                for workload, function in workloads:
+                    for run in range(repetitions):
+                        r = function(x, elements)
+                        datafile.write(f"{x} {domain} {workload} {run} "
+                                       f"{r.num_items} {r.time*1000} "
+                                       f"{r.num_items/r.time} {r.num_Steal}\n")
+        binary.SetStealDomains(0)
+        binary.SetSummary(0)
+
+# NUM_LANES in src/config.h
+NUM_LANES = 4
+
+class cLanesResult(ctypes.Structure):
+    '''
+    This has to match struct lanes_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("time", ctypes.c_float),
+                 ("num_items", ctypes.c_int),
+                 ("num", ctypes.c_long * NUM_LANES),
+                 ("p50_ns", ctypes.c_long * NUM_LANES),
+                 ("p99_ns", ctypes.c_long * NUM_LANES),
+                 ("p999_ns", ctypes.c_long * NUM_LANES) ]
+
+def write_lanes_data(binary, elements, repetitions, xrange, basedir, name):
+    '''
+    Runs the mixed urgent and bulk workload through one lane and through
+    the priority lanes, and writes the latency percentiles of every lane.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x lanes run lane num_elems time items p50_ns p99_ns p999_ns\n")
+        for x in xrange:
+            for use_lanes in (0, 1):
+                for run in range(repetitions):
+                    r = binary.benchmark_lanes(x, elements, use_lanes)
+                    for lane in range(NUM_LANES):
+                        datafile.write(f"{x} {use_lanes} {run} {lane} "
+                                       f"{r.num_items} {r.time*1000} "
+                                       f"{r.num[lane]} {r.p50_ns[lane]} "
+                                       f"{r.p99_ns[lane]} {r.p999_ns[lane]}\n")
+
+# Primitives in the order of the MICRO_* enum in concurrentBagsSimple.c
+MICRO_PRIMITIVES = ["add", "add_new_block", "remove", "retire",
+                    "steal_warm", "steal_cold", "empty"]
+
+class cMicroResult(ctypes.Structure):
+    '''
+    This has to match struct micro_result in concurrentBagsSimple.c
+    '''
+    _fields_ = [ ("cycles", ctypes.c_long * len(MICRO_PRIMITIVES)),
+                 ("samples", ctypes.c_long * len(MICRO_PRIMITIVES)),
+                 ("overhead", ctypes.c_long) ]
+
+def write_micro_data(binary, samples, repetitions, xrange, basedir, name):
+    '''
+    Times the bag primitives one call at a time and writes the median
+    cycles of every primitive and run.
+    '''
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x run primitive cycles samples overhead\n")
+        for x in xrange:
+            for run in range(repetitions):
+                r = binary.benchmark_micro(x, samples)
+                for i, primitive in enumerate(MICRO_PRIMITIVES):
+                    datafile.write(f"{x} {run} {primitive} {r.cycles[i]} "
+                                   f"{r.samples[i]} {r.overhead}\n")
+
+class cWorkloadPhase(ctypes.Structure):
+    '''
+    This has to match struct workload_phase in src/workload.h
+    '''
+    _fields_ = [ ("ops_per_thread", ctypes.c_int),
+                 ("add_ratio", ctypes.c_float),
+                 ("burst_on", ctypes.c_int),
+                 ("burst_off", ctypes.c_int),
+                 ("zipf_s", ctypes.c_float),
+                 ("payload", ctypes.c_int) ]
+
+# MAX_PHASES in src/workload.h
+MAX_PHASES = 8
+
+class cWorkloadResult(ctypes.Structure):
+    '''
+    This has to match struct workload_result in src/workload.h
+    '''
+    _fields_ = [ ("num_phases", ctypes.c_int),
+                 ("time", ctypes.c_float * MAX_PHASES),
+                 ("num_add", ctypes.c_long * MAX_PHASES),
+                 ("num_remove", ctypes.c_long * MAX_PHASES),
+                 ("num_null", ctypes.c_long * MAX_PHASES) ]
+
+def write_workload_data(bench_function, phases, repetitions, xrange, basedir, name):
+    '''
+    Runs a phased workload given as a list of (name, workload_phase) and
+    writes the throughput of every phase and run.
+    '''
+    cphases = (cWorkloadPhase * len(phases))(*[phase for _, phase in phases])
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x run phase time num_add num_remove num_null throughput\n")
+        for x in xrange:
+            for run in range(repetitions):
+                r = cWorkloadResult()
+                bench_function(x, cphases, len(phases), ctypes.byref(r))
+                for p in range(r.num_phases):
+                    ops = r.num_add[p] + r.num_remove[p] + r.num_null[p]
+                    datafile.write(f"{x} {run} {phases[p][0]} {r.time[p]*1000} {r.num_add[p]} "
+                                   f"{r.num_remove[p]} {r.num_null[p]} {ops/r.time[p]}\n")
+
+def write_steal_matrix(binary, bench_function, x, elements, basedir, name):
+    '''
+    Runs one benchmark with x threads and writes who stole from whom
+    (steal_matrix.data, one block of rows per thief for pgfplots' matrix
+    plot) and the items each thread added and removed (imbalance.data).
+    '''
+    bench_function(x, elements)
+    hits = (ctypes.c_long * (x * x))()
+    misses = (ctypes.c_long * (x * x))()
+    added = (ctypes.c_long * x)()
+    removed = (ctypes.c_long * x)()
+    binary.StealMatrix(x, hits, misses, added, removed)
+
+    os.makedirs(f"{basedir}/data/{name}", exist_ok=True)
+    with open(f"{basedir}/data/{name}/steal_matrix.data", "w") as datafile:
+        datafile.write("thief victim hits misses success_rate\n")
+        for thief in range(x):
+            for victim in range(x):
+                h, m = hits[thief * x + victim], misses[thief * x + victim]
+                datafile.write(f"{thief} {victim} {h} {m} {h / (h + m) if h + m else 0}\n")
+            datafile.write("\n")
+    with open(f"{basedir}/data/{name}/imbalance.data", "w") as datafile:
+        datafile.write("thread added removed net stolen_by_others\n")
+        for t in range(x):
+            stolen = sum(hits[thief * x + t] for thief in range(x) if thief != t)
+            datafile.write(f"{t} {added[t]} {removed[t]} {added[t] - removed[t]} {stolen}\n")
+
+    mean = sum(removed) / x
+    squares = sum(r * r for r in removed)
+    print(f"{name}: removes per thread min {min(removed)} max {max(removed)} "
+          f"max/mean {max(removed) / mean if mean else 0:.2f} "
+          f"Jain {sum(removed) ** 2 / (x * squares) if squares else 0:.3f}, "
+          f"{sum(hits)} steals hit, {sum(misses)} missed")
+
+def write_spike_drain_data(bench_function, elements, xrange, basedir, name):
+    '''
+    Runs the spike-then-drain benchmark once per point and writes the
+    resident set size after each phase in kB.
+    '''
+    try:
+        os.makedirs(f"{basedir}/data/{name}")
+    except FileExistsError:
+        pass
+    with open(f"{basedir}/data/{name}/{name}.data", "w") as datafile:
+        datafile.write("x num_elems time rss_start rss_peak rss_drained rss_trimmed\n")
+        for x in xrange:
+            r = bench_function(x, elements)
+            datafile.write(f"{x} {r.num_items} {r.time*1000} {r.rss_start_kb} {r.rss_peak_kb} {r.rss_drained_kb} {r.rss_trimmed_kb}\n")
+
+# Column names of one sample as stored by Benchmark.run
+FIELDS = ("time", "num_items", "num_CASSuc", "num_CASFail", "num_Steal",
+          "max_list_length", "bytes_per_item", "dtlb_misses", "cache_misses",
+          "cpu_ns", "num_removed", "num_null", "empty_ns",
+          "remove_jain", "remove_max_min", "max_gap_ns")
+
+# Two-sided 95% quantiles of Student's t distribution for 1..30 degrees of
+# freedom. Larger samples use the normal quantile.
+T_95 = (12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042)
+
+def t_quantile(df):
+    if df < 1:
+        return float("inf")
+    if df <= len(T_95):
+        return T_95[int(df) - 1]
+    return 1.960
+
+def describe(values):
+    '''
+    Returns mean, median, standard deviation and the 95% confidence interval
+    of the mean for a list of samples.
+    '''
+    n = len(values)
+    mean = statistics.fmean(values)
+    median = statistics.median(values)
+    stddev = statistics.stdev(values) if n > 1 else 0.0
+    half = t_quantile(n - 1) * stddev / math.sqrt(n) if n > 1 else 0.0
+    return mean, median, stddev, mean - half, mean + half
+
+def welch_significant(a, b):
+    '''
+    Welch's t-test: True if the means of the samples a and b differ at the 5%
+    level. A single baseline value (as in averaged .data files) is compared
+    against the confidence interval of a instead.
+    '''
+    if len(a) < 2:
+        return False
+    va = statistics.variance(a) / len(a)
+    if len(b) < 2:
+        _, _, _, low, high = describe(a)
+        return not low <= b[0] <= high
+    vb = statistics.variance(b) / len(b)
+    if va + vb == 0:
+        return statistics.fmean(a) != statistics.fmean(b)
+    t = (statistics.fmean(a) - statistics.fmean(b)) / math.sqrt(va + vb)
+    df = (va + vb) ** 2 / (va ** 2 / (len(a) - 1) + vb ** 2 / (len(b) - 1))
+    return abs(t) > t_quantile(math.floor(df))
 
 class Benchmark:
     '''
     Class representing a benchmark. It assumes any benchmark sweeps over some
-    parameter xrange using the fixed set of inputs for every point. It provides
-    two ways of averaging over the given amount of repetitions:
-    - represent everything in a boxplot, or
-    - average over the results.
+    parameter xrange using the fixed set of inputs for every point. The first
+    warmup repetitions of every point are discarded, the rest are kept as raw
+    samples and summarised by write_avg_data.
     '''
     def __init__(self, bench_function, parameters,
-                 repetitions_per_point, xrange, basedir, name):
+                 repetitions_per_point, xrange, basedir, name, warmup=1):
         self.bench_function = bench_function
         self.parameters = parameters
         self.repetitions_per_point = repetitions_per_point
         self.xrange = xrange
         self.basedir = basedir
         self.name = name
+        self.warmup = warmup
 
         self.data = {}
         self.now = None
@@ -41,65 +479,236 @@ class Benchmark:
         dictionary to be processed later.
         '''
         self.now = datetime.datetime.now().strftime("%Y-%m-%dT%H:%M:%S")
-        print(f"Starting Benchmark run at {self.now}")
+        print(f"Starting Benchmark {self.name} at {self.now}")
 
         for x in self.xrange:
             tmp = []
             for r in range(0, self.repetitions_per_point):
                 result = self.bench_function( x, *self.parameters )
-                tmp.append( (result.time*1000,result.num_items,result.num_CASSuc, result.num_CASFail, result.num_Steal) )
+                if r < self.warmup:
+                    continue
+                tmp.append( (result.time*1000,result.num_items,result.num_CASSuc, result.num_CASFail, result.num_Steal,
+                             result.max_list_length, result.bytes_per_item,
+                             result.dtlb_misses, result.cache_misses,
+                             result.cpu_ns, result.num_removed, result.num_null,
+                             result.empty_ns, result.remove_jain,
+                             result.remove_max_min, result.max_gap_ns) )
             self.data[x] = tmp
 
-    def write_avg_data(self):
+    def directory(self):
+        path = f"{self.basedir}/data/{self.name}"
+        os.makedirs(path, exist_ok=True)
+        return path
+
+    def write_raw_data(self):
         '''
-        Writes averages for each point measured into a dataset in the data
-        folder timestamped when the run was started.
+        Writes every kept sample to <name>.json and <name>.csv, so that runs
+        can later be compared sample by sample.
         '''
         if self.now is None:
             raise Exception("Benchmark was not run. Run before writing data.")
 
-        try:
-            os.makedirs(f"{self.basedir}/data/{self.name}")
-        except FileExistsError:
-            pass
-        with open(f"{self.basedir}/data/{self.name}/{self.name}.data", "w")\
-                as datafile:
-            datafile.write(f"x num_elems avg_time throughput num_CAS_success num_CAS_fails num_Steal\n")
+        path = self.directory()
+        with open(f"{path}/{self.name}.json", "w") as jsonfile:
+            json.dump({"name": self.name, "started": self.now,
+                       "parameters": list(self.parameters),
+                       "warmup": self.warmup, "fields": FIELDS,
+                       "samples": {str(x): box for x, box in self.data.items()}},
+                      jsonfile, indent=1)
+        with open(f"{path}/{self.name}.csv", "w", newline="") as csvfile:
+            writer = csv.writer(csvfile)
+            writer.writerow(("x", "repetition") + FIELDS)
+            for x, box in self.data.items():
+                for r, item in enumerate(box):
+                    writer.writerow((x, r + self.warmup) + tuple(item))
+
+    def write_avg_data(self):
+        '''
+        Writes averages for each point measured into a dataset in the data
+        folder, followed by the spread of the time samples. Raw samples are
+        written alongside.
+        '''
+        self.write_raw_data()
+        with open(f"{self.directory()}/{self.name}.data", "w") as datafile:
+            datafile.write(f"x num_elems avg_time throughput num_CAS_success num_CAS_fails num_Steal max_list_length bytes_per_item dtlb_misses cache_misses cpu_ns num_removed num_null empty_ns remove_jain remove_max_min max_gap_ns cpu_ns_per_item median_time stddev_time ci95_low ci95_high num_samples\n")
             for x, box in self.data.items():
-                times = 0
-                Cassuc = 0
-                Casfail = 0
-                Steal = 0
-                skip = 0
-                for item in box:
-                    if skip== 0:
-                        skip +=1
-                        continue
-                    times += item[0]
-                    Cassuc += item[2]
-                    Casfail += item[3]
-                    Steal += item[4]
-                    num_elems = item[1]
-                avg_time = times/len(box)
-                Cassuc = Cassuc/len(box)
-                Casfail = Casfail/len(box)
-                Steal = Steal/len(box)
-                datafile.write(f"{x} {num_elems} {avg_time} {num_elems*1000/avg_time} {Cassuc} {Casfail} {Steal}\n")
-
-def benchmark():
+                columns = list(zip(*box))
+                avg_time, median, stddev, low, high = describe(columns[0])
+                num_elems = columns[1][-1]
+                avgs = [statistics.fmean(c) for c in columns[2:]]
+                # CPU time per item that reached a consumer, so that spinning
+                # on an empty bag costs even where it does not cost wall time
+                cpu_ns, removed = avgs[7], avgs[8]
+                avgs.append(cpu_ns / removed if removed else math.nan)
+                datafile.write(f"{x} {num_elems} {avg_time} {num_elems*1000/avg_time} "
+                               + " ".join(str(a) for a in avgs)
+                               + f" {median} {stddev} {low} {high} {len(box)}\n")
+
+def read_samples(path, name):
+    '''
+    Reads the time samples of a workload below path as {x: [ms, ...]}.
+    Prefers raw samples; older data only has averages in the .data file.
+    '''
+    for base in (f"{path}/data", path):
+        raw = f"{base}/{name}/{name}.json"
+        if os.path.exists(raw):
+            with open(raw) as jsonfile:
+                samples = json.load(jsonfile)["samples"]
+            return {int(x): [item[0] for item in box] for x, box in samples.items()}
+        avg = f"{base}/{name}/{name}.data"
+        if os.path.exists(avg):
+            with open(avg) as datafile:
+                header = datafile.readline().split()
+                col = header.index("avg_time")
+                return {int(row[0]): [float(row[col])]
+                        for row in (line.split() for line in datafile) if row}
+    return None
+
+def compare(basedir, baseline, names):
+    '''
+    Compares the time samples of every workload and thread count against a
+    baseline run. Slowdowns that are significant at the 5% level are flagged
+    as regressions. Writes data/comparison.csv and returns the number of
+    regressions.
+    '''
+    regressions = 0
+    rows = []
+    for name in names:
+        current = read_samples(basedir, name)
+        base = read_samples(baseline, name)
+        if current is None or base is None:
+            continue
+        for x in sorted(set(current) & set(base)):
+            mean = statistics.fmean(current[x])
+            base_mean = statistics.fmean(base[x])
+            change = (mean - base_mean) / base_mean * 100
+            significant = welch_significant(current[x], base[x])
+            verdict = "same"
+            if significant:
+                verdict = "REGRESSION" if mean > base_mean else "improvement"
+            regressions += verdict == "REGRESSION"
+            rows.append((name, x, base_mean, mean, change, verdict))
+            print(f"{name:40} {x:4} {base_mean:10.3f} ms -> {mean:10.3f} ms {change:+7.1f}% {verdict}")
+    os.makedirs(f"{basedir}/data", exist_ok=True)
+    with open(f"{basedir}/data/comparison.csv", "w", newline="") as csvfile:
+        writer = csv.writer(csvfile)
+        writer.writerow(("workload", "x", "baseline_ms", "current_ms", "change_percent", "verdict"))
+        writer.writerows(rows)
+    return regressions
+
+# Library settings a sweep may change. Every sweep starts from these.
+DEFAULT_SETTINGS = {"SetOwnerFastPath": 1, "SetStealMode": 0, "SetArena": 0,
+                    "SetBackoffPolicy": 0, "SetYieldOnEmpty": 0, "SetSummary": 0,
+                    "SetWorkSharing": 0, "SetElimination": 0,
+                    "SetCompaction": 0, "SetStealDomains": 0}
+
+def sweeps(elements):
+    '''
+    All sweeps as (name, library, function, parameters, settings). They are
+    independent of each other, so they may run in separate processes.
+    '''
+    # Parameters for the benchmark are passed in a tuple, here (1000,). To pass
+    # just one parameter, we cannot write (1000) because that would not parse
+    # as a tuple, instead python understands a trailing comma as a tuple with
+    # just one entry.
+    result = [
+        ("benchrand_10000", "simple", "benchmark_random", (elements,), {}),
+        ("benchrand_10000_queue", "queue", "benchmark_random", (elements,), {}),
+        ("bench_add_remove_10000", "simple", "benchmark_add_remove", (elements,), {}),
+        # Same workload with the owner taking every item by CAS, for comparison
+        ("bench_add_remove_10000_cas", "simple", "benchmark_add_remove", (elements,),
+         {"SetOwnerFastPath": 0}),
+        ("bench_half_half_10000", "simple", "benchmark_half_half", (elements,), {}),
+        ("bench_one_producer_10000", "simple", "benchmark_one_producer", (elements,), {}),
+        # Every block is stolen from here, so every block costs the thieves a
+        # membarrier while the owner fast path is on
+        ("bench_one_producer_10000_cas", "simple", "benchmark_one_producer", (elements,),
+         {"SetOwnerFastPath": 0}),
+        ("bench_one_consumer_10000", "simple", "benchmark_one_consumer", (elements,), {}),
+        # Thieves steal from the oldest blocks instead of the owner's hot one
+        ("bench_one_producer_10000_cold", "simple", "benchmark_one_producer", (elements,),
+         {"SetStealMode": 1}),
+        ("bench_half_half_10000_cold", "simple", "benchmark_half_half", (elements,),
+         {"SetStealMode": 1}),
+        ("bench_deep_steal_1000000", "simple", "benchmark_deep_steal", (100 * elements,), {}),
+        ("bench_deep_steal_1000000_cas", "simple", "benchmark_deep_steal", (100 * elements,),
+         {"SetOwnerFastPath": 0}),
+        # Same lists with blocks carved from huge-page backed chunks
+        ("bench_deep_steal_1000000_arena", "simple", "benchmark_deep_steal", (100 * elements,),
+         {"SetArena": 1}),
+    ]
+    # Cost of polling an empty bag, with and without the summary bitmap,
+    # and stealing guided by it
+    result.append(("bench_empty_poll_10000", "simple", "benchmark_empty_poll", (elements,), {}))
+    result.append(("bench_empty_poll_10000_summary", "simple", "benchmark_empty_poll",
+                   (elements,), {"SetSummary": 1}))
+    result.append(("bench_one_producer_10000_summary", "simple", "benchmark_one_producer",
+                   (elements,), {"SetSummary": 1}))
+    # The full bag runs the same workloads for comparison with the simple
+    # bag and the queue
+    for workload, base in (("random", "benchrand_10000"),
+                           ("add_remove", "bench_add_remove_10000"),
+                           ("half_half", "bench_half_half_10000"),
+                           ("one_producer", "bench_one_producer_10000"),
+                           ("one_consumer", "bench_one_consumer_10000")):
+        result.append((f"{base}_full", "full", f"benchmark_{workload}", (elements,), {}))
+    # Producer throughput under thieves for every backoff policy
+    for policy, policy_name in enumerate(["none", "exponential", "adaptive"]):
+        result.append((f"bench_thief_contention_1000000_{policy_name}", "simple",
+                       "benchmark_thief_contention", (100 * elements,),
+                       {"SetBackoffPolicy": policy}))
+    result.append(("bench_thief_contention_1000000_none_cas", "simple",
+                   "benchmark_thief_contention", (100 * elements,),
+                   {"SetOwnerFastPath": 0}))
+    return result
+
+def load_libraries(basedir):
     '''
     Requires the binary to also be present as a shared library.
     '''
-    basedir = os.path.dirname(os.path.abspath(__file__))
     binary = ctypes.CDLL( f"{basedir}/concurrentBagsSimple.so" )
     binary_queue = ctypes.CDLL( f"{basedir}/queue.so" )
+    binary_full = ctypes.CDLL( f"{basedir}/concurrentBags.so" )
     # Set the result type for each benchmark function
     binary.benchmark_add_remove.restype = cBenchResult
     binary.benchmark_random.restype = cBenchResult
     binary.benchmark_half_half.restype = cBenchResult
     binary.benchmark_one_producer.restype = cBenchResult
     binary.benchmark_one_consumer.restype = cBenchResult
+    binary.benchmark_spike_drain.restype = cTrimResult
+    binary.benchmark_deep_steal.restype = cBenchResult
+    binary.benchmark_thief_contention.restype = cBenchResult
+    binary.benchmark_empty_poll.restype = cBenchResult
+    binary.benchmark_oversubscribed.restype = cOversubResult
+    binary.benchmark_eventfd.restype = cEventfdResult
+    binary.benchmark_shared.restype = cSharedResult
+    binary.benchmark_sharing.restype = cSharingResult
+    binary.benchmark_micro.restype = cMicroResult
+    binary.benchmark_elimination.restype = cElimResult
+    binary.benchmark_compaction.restype = cCompactResult
+    binary.benchmark_lanes.restype = cLanesResult
+    binary.TraceExport.restype = ctypes.c_long
     binary_queue.benchmark_random.restype = cBenchResult
+    for workload in ("add_remove", "random", "half_half", "one_producer", "one_consumer"):
+        getattr(binary_full, f"benchmark_{workload}").restype = cBenchResult
+    return {"simple": binary, "queue": binary_queue, "full": binary_full}
+
+def run_sweep(basedir, sweep, num_threads, repetitions):
+    name, library, function, parameters, settings = sweep
+    libraries = load_libraries(basedir)
+    binary = libraries["simple"]
+    for setter, value in {**DEFAULT_SETTINGS, **settings}.items():
+        getattr(binary, setter)(value)
+    bench = Benchmark(getattr(libraries[library], function), parameters,
+                      repetitions, num_threads, basedir, name)
+    bench.run()
+    bench.write_avg_data()
+    for setter, value in DEFAULT_SETTINGS.items():
+        getattr(binary, setter)(value)
+    return name
+
+def benchmark(jobs=1, repetitions=11, baseline=None, only=None):
+    basedir = os.path.dirname(os.path.abspath(__file__))
 
     # The number of threads. This is the x-axis in the benchmark, i.e., the
     # parameter that is 'sweeped' over.
@@ -109,41 +718,115 @@ def benchmark():
     num_threads = sorted(num_threads)
     elements = 10000
 
-    # Parameters for the benchmark are passed in a tuple, here (1000,). To pass
-    # just one parameter, we cannot write (1000) because that would not parse
-    # as a tuple, instead python understands a trailing comma as a tuple with
-    # just one entry.
-    benchrand_10000 = Benchmark(binary.benchmark_random, (elements,), 11,
-                              num_threads, basedir, "benchrand_10000")
-    
-    bench_add_remove_10000 = Benchmark(binary.benchmark_add_remove, (elements,), 11,
-                              num_threads, basedir, "bench_add_remove_10000")
-    
-    bench_half_half_10000 = Benchmark(binary.benchmark_half_half, (elements,), 11,
-                              num_threads, basedir, "bench_half_half_10000")
-    
-    bench_one_producer_10000 = Benchmark(binary.benchmark_one_producer, (elements,), 11,
-                              num_threads, basedir, "bench_one_producer_10000")
-    
-    bench_one_consumer_10000 = Benchmark(binary.benchmark_one_consumer, (elements,), 11,
-                              num_threads, basedir, "bench_one_consumer_10000")
-
-    benchrand_10000_queue = Benchmark(binary_queue.benchmark_random, (elements,), 11,
-                               num_threads, basedir, "benchrand_10000_queue")
-
-    benchrand_10000.run()
-    benchrand_10000.write_avg_data()
-    benchrand_10000_queue.run()
-    benchrand_10000_queue.write_avg_data()
-    bench_add_remove_10000.run()
-    bench_add_remove_10000.write_avg_data()
-    bench_half_half_10000.run()
-    bench_half_half_10000.write_avg_data()
-    bench_one_producer_10000.run()
-    bench_one_producer_10000.write_avg_data()
-    bench_one_consumer_10000.run()
-    bench_one_consumer_10000.write_avg_data()
+    # Sweeps running side by side compete for cores, which only leaves the
+    # timings intact while every sweep still gets a core per thread.
+    if jobs > 1 and jobs * max(num_threads) > os.cpu_count():
+        print(f"Warning: {jobs} jobs with up to {max(num_threads)} threads "
+              f"oversubscribe {os.cpu_count()} cores", file=sys.stderr)
+
+    work = sweeps(elements)
+    if only is not None:
+        work = [sweep for sweep in work if sweep[0] == only]
+    if jobs > 1:
+        # Every sweep runs in a fresh interpreter with its own copy of the
+        # libraries, so global state in the bag is never shared between
+        # sweeps. (multiprocessing cannot be used here: queue.so next to this
+        # script shadows the queue module it imports.)
+        running = []
+        for sweep in work:
+            if len(running) == jobs:
+                running.pop(0).wait()
+            running.append(subprocess.Popen(
+                [sys.executable, os.path.abspath(__file__), "--only", sweep[0],
+                 "-r", str(repetitions)]))
+        for process in running:
+            process.wait()
+    else:
+        for sweep in work:
+            run_sweep(basedir, sweep, num_threads, repetitions)
+    if only is not None:
+        return 0
+
+    binary = load_libraries(basedir)["simple"]
+    write_spike_drain_data(binary.benchmark_spike_drain, 100 * elements,
+                           num_threads, basedir, "bench_spike_drain_1000000")
+    write_oversubscription_data(binary, 100 * elements, repetitions, basedir,
+                                "bench_oversubscribed_1000000")
+    write_eventfd_data(binary, 10 * elements, repetitions,
+                       [x for x in num_threads if x > 1], basedir,
+                       "bench_eventfd_100000")
+    write_sharing_data(binary, elements, repetitions, num_threads, basedir,
+                       "bench_sharing_10000")
+    write_micro_data(binary, elements, repetitions, [1, max(num_threads)],
+                     basedir, "bench_micro_10000")
+    # Balanced mixes up to many more threads than the sweeps use
+    write_elimination_data(binary, 100 * elements, repetitions,
+                           [8, 16, 32, MAX_NR_THREADS], basedir,
+                           "bench_elimination_1000000")
+    write_compaction_data(binary, 100 * elements, repetitions, num_threads,
+                          basedir, "bench_compaction_1000000")
+    write_lanes_data(binary, 100 * elements, repetitions,
+                     [x for x in num_threads if x > 1], basedir,
+                     "bench_lanes_1000000")
+    # Scaling past one summary word, on machines with that many threads
+    write_domain_data(binary, 100 * elements, repetitions,
+                      [32, 64, 128, MAX_NR_THREADS], basedir,
+                      "bench_domains_1000000")
+
+    # Processes instead of threads, against a pipe
+    write_shared_data(binary, 100 * elements, repetitions, num_threads,
+                      basedir, "bench_shared_1000000")
+
+    # Who steals from whom at the largest thread count
+    for workload in ("random", "half_half", "one_producer"):
+        write_steal_matrix(binary, getattr(binary, f"benchmark_{workload}"),
+                           max(num_threads), elements, basedir,
+                           f"steal_matrix_{workload}_10000")
+
+    # With the tracer compiled in (make TRACE=1), keep a timeline of one
+    # producer feeding all other threads
+    binary.benchmark_one_producer(max(num_threads), elements)
+    events = binary.TraceExport(f"{basedir}/data/trace_one_producer.json".encode())
+    if events >= 0:
+        print(f"Wrote {events} trace events to data/trace_one_producer.json")
+
+    # Non-stationary traffic: producer-heavy, then consumer-heavy, then
+    # bursts, then a few hot producers with work per item
+    phases = [("produce", cWorkloadPhase(elements, 0.8, 0, 0, 0, 0)),
+              ("consume", cWorkloadPhase(elements, 0.2, 0, 0, 0, 0)),
+              ("bursts", cWorkloadPhase(elements, 0.5, 64, 256, 0, 0)),
+              ("zipf", cWorkloadPhase(elements, 0.5, 0, 0, 1.2, 50))]
+    libraries = load_libraries(basedir)
+    for library, suffix in ((binary, ""), (libraries["full"], "_full"),
+                            (libraries["queue"], "_queue")):
+        write_workload_data(library.benchmark_workload, phases, repetitions,
+                            num_threads, basedir, f"bench_workload_10000{suffix}")
+
+    if baseline is not None:
+        return compare(basedir, baseline, [sweep[0] for sweep in work])
+    return 0
 
 
 if __name__ == "__main__":
-    benchmark()
+    parser = argparse.ArgumentParser(description="Runs the bag benchmarks.")
+    parser.add_argument("-j", "--jobs", type=int, default=1,
+                        help="independent sweeps to run in parallel processes")
+    parser.add_argument("-r", "--repetitions", type=int, default=11,
+                        help="runs per point, the first is discarded as warmup")
+    parser.add_argument("-b", "--baseline",
+                        help="directory of a previous run to compare against, e.g. nebula_data")
+    parser.add_argument("--only", help="run just the sweep with this name")
+    parser.add_argument("--compare-only", action="store_true",
+                        help="only compare the existing data/ against the baseline")
+    args = parser.parse_args()
+    if args.compare_only:
+        if args.baseline is None:
+            parser.error("--compare-only needs --baseline")
+        basedir = os.path.dirname(os.path.abspath(__file__))
+        regressions = compare(basedir, args.baseline,
+                              [sweep[0] for sweep in sweeps(10000)])
+    else:
+        regressions = benchmark(args.jobs, args.repetitions, args.baseline, args.only)
+    if regressions:
+        print(f"{regressions} significant regressions", file=sys.stderr)
+    sys.exit(1 if regressions else 0)
@@ -1,100 +1,31 @@
 #include "concurrentBags.h"
-#include <omp.h>
+#include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
 
-
+// Unit test of the full bag: ./UT_concurrentBags [threads] [ops] fails
+// unless every added item is removed exactly once.
 int main(int argc, char * argv[]) {
-    double tic, toc;
-    int threads;
-    if (argc == 2)
-    {
-        threads = (int)strtol(argv[1], NULL, 10);
-    } else threads = 10;
-
-    printf("Running with %d threads\r\n", threads);
-
-    
-    InitBag(threads);
-
-    omp_set_num_threads(threads);
-
-    tic = omp_get_wtime();
-
-    /*
-    #pragma omp parallel for
-    for (int i = 0; i < omp_get_num_threads(); i++)
-    {
-        int id = omp_get_thread_num();
-        InitThread(id);
-    }
-    for (int i = 0; i < omp_get_num_threads(); i++)
+    int threads = argc >= 2 ? (int)strtol(argv[1], NULL, 10) : 10;
+    long ops = argc >= 3 ? strtol(argv[2], NULL, 10) : 1000000;
+    if (threads < 1 || threads > MAX_NR_THREADS)
     {
-        int id = omp_get_thread_num();
-        if (id == 0)
-        {
-            int *item = malloc(sizeof(int));
-            *item = id;
-            Add(item);
-        } else
-        {
-            int *result = (int*)TryRemoveAny();
-            if (result == NULL)
-            {
-                 printf("Bag was empty\r\n");
-            } else
-            printf("Received %d\r\n", *result);
-        }
-        
-        
+        fprintf(stderr, "validate: threads must be 1 to %d\n", MAX_NR_THREADS);
+        return EXIT_FAILURE;
     }
-    */
 
-    long genresult = 0;
-    int multiply = 100;
-    #pragma omp parallel for reduction(+:genresult) private(threadBlock, stealBlock, stealPrev, foundAdd, threadHead, stealHead, stealIndex, threadID)
-    for (int i = 0; i < omp_get_num_threads(); i++)
-    {
-        int id = omp_get_thread_num();
-        int mult = multiply;
-        long result = 0;
-        InitThread(id);
+    printf("Running with %d threads\r\n", threads);
 
-        printf("Hello from thread %d\r\n", id + 1);
-        int *inc = NULL;
-        
-        if (i < threads/2)
-        {
-        for (int j = 0; j < mult*(id+1); j++)
-        {
-            int *item = malloc(sizeof(int));
-            *item = id + 1;
-            Add(item);
-        }
-        } else {
-        
-        do
-        {
-            inc = (int*)(TryRemoveAny());
-            if (inc != (int*)NULL) {
-                result += (long)*inc;
-                genresult += (long)*inc;
-            }
-        } while (inc != NULL);
-        printf("Thread %d got result %ld\r\n", id + 1, result);
-        }
-                
-    }
-    long expected = 0;
-    for (int i = 0; i < threads/2; i++)
+    struct validate_result res = benchmark_validate(threads, ops);
+    printf("Validated %ld ops with %d threads in %f s: %ld added, %ld "
+           "removed, %ld lost, %ld duplicated\r\n",
+           res.num_ops, threads, res.time, res.num_added, res.num_removed,
+           res.num_lost, res.num_duplicated);
+    if (res.num_lost != 0 || res.num_duplicated != 0)
     {
-        expected += multiply*(i+1)*(i+1);
+        fprintf(stderr, "VALIDATION FAILED: %ld lost, %ld duplicated\n",
+                res.num_lost, res.num_duplicated);
+        return EXIT_FAILURE;
     }
-    
-    printf("Got %ld overall, from %ld possible\r\n", genresult, expected);
-    
-        
-    toc = omp_get_wtime();
-
-    printf("Unit test took %lf seconds \r\n", toc - tic);
-}
\ No newline at end of file
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+// Resume latency and throughput of co_await bag.remove() with thousands of
+// suspended consumers (make await-bench). Arguments: items per run and
+// the largest number of threads.
+//
+// Every thread runs an event loop with its own ready queue and is the home
+// executor of consumers/threads coroutines. Consumers loop on
+// co_await bag.remove(); a consumer woken by an Add on another thread is
+// posted back to its home loop. Between loop turns each thread adds its
+// share of the items, stamped with the time of the Add. The latency of an
+// item runs from its Add until its consumer resumes.
+#include "concurrentBagsSimple.hpp"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+long NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Fire and forget coroutine, frees itself when it returns
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+struct alignas(64) Loop {
+  std::mutex lock;
+  std::vector<std::coroutine_handle<>> ready;
+  std::vector<long> latency;
+
+  void Post(std::coroutine_handle<> handle) {
+    std::lock_guard<std::mutex> guard(lock);
+    ready.push_back(handle);
+  }
+
+  // Resumes everything posted so far, returns false if there was nothing
+  bool RunOnce() {
+    std::vector<std::coroutine_handle<>> batch;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      batch.swap(ready);
+    }
+    for (auto handle : batch)
+      handle.resume();
+    return !batch.empty();
+  }
+};
+
+struct LoopExecutor {
+  Loop *loop;
+  void execute(std::coroutine_handle<> handle) const { loop->Post(handle); }
+};
+
+long stopItem; // Ends a consumer
+std::atomic<long> consumed, finished;
+
+Task Consumer(bag::Bag &bag, Loop *home) {
+  for (;;) {
+    void *item = co_await bag.remove(LoopExecutor{home});
+    if (item == &stopItem)
+      break;
+    home->latency.push_back(NowNs() - *static_cast<long *>(item));
+    consumed.fetch_add(1, std::memory_order_relaxed);
+  }
+  finished.fetch_add(1);
+}
+
+void Run(int num_threads, int num_consumers, long num_items) {
+  bag::Bag bag;
+  std::vector<Loop> loops(num_threads);
+  std::vector<long> stamps(num_items);
+  consumed = 0;
+  finished = 0;
+  bag::Bag::init(num_threads);
+  double tic = 0, toc = 0;
+
+#pragma omp parallel num_threads(num_threads)
+  {
+    int id = omp_get_thread_num();
+    Loop *home = &loops[id];
+    bag::Bag::init_thread(id);
+    // Spread the consumers, they all suspend on the empty bag
+    for (int c = id; c < num_consumers; c += num_threads)
+      Consumer(bag, home);
+#pragma omp barrier
+#pragma omp master
+    tic = omp_get_wtime();
+    long first = num_items * id / num_threads;
+    long last = num_items * (id + 1) / num_threads;
+    for (long i = first; i < last; i++) {
+      home->RunOnce();
+      stamps[i] = NowNs();
+      bag.add(&stamps[i]);
+    }
+    while (consumed.load(std::memory_order_relaxed) < num_items)
+      home->RunOnce();
+#pragma omp master
+    {
+      toc = omp_get_wtime();
+      for (int c = 0; c < num_consumers; c++)
+        bag.add(&stopItem);
+    }
+    while (finished.load() < num_consumers)
+      home->RunOnce();
+  }
+
+  std::vector<long> latency;
+  for (auto &loop : loops)
+    latency.insert(latency.end(), loop.latency.begin(), loop.latency.end());
+  std::sort(latency.begin(), latency.end());
+  auto percentile = [&](double p) {
+    return latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))];
+  };
+  std::printf("%7d %9d %9ld %12.0f %9ld %9ld %9ld\n", num_threads,
+              num_consumers, num_items, num_items / (toc - tic),
+              percentile(0.5), percentile(0.99), percentile(0.999));
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  long num_items = argc > 1 ? std::atol(argv[1]) : 1000000;
+  int max_threads = argc > 2 ? std::atoi(argv[2]) : omp_get_num_procs();
+  std::printf("%7s %9s %9s %12s %9s %9s %9s\n", "threads", "consumers",
+              "items", "items/s", "p50_ns", "p99_ns", "p999_ns");
+  for (int consumers : {1024, 4096, 16384})
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+      Run(threads, consumers, num_items);
+  return 0;
+}
@@ -0,0 +1,193 @@
+#include "bench.h"
+
+#include <omp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void FillCounters(struct bench_result *result,
+                  const struct thread_counters *counters, int num_threads) {
+  long cassuc = 0, casfail = 0, steal = 0, maxlist = 0;
+  long adds = 0, bytes = 0, dtlb = 0, cache = 0;
+  long cpu = 0, removes = 0, nulls = 0;
+  bool nodtlb = false, nocache = false;
+  uint64_t ticks = 0, gap = 0, now = ClockTicks();
+  long *perThread = malloc(num_threads * sizeof(long));
+  int consumers = 0;
+
+  for (int i = 0; i < num_threads; i++) {
+    const struct thread_counters *c = &counters[i];
+    cassuc += c->cas_success;
+    casfail += c->cas_fail;
+    steal += c->steal;
+    adds += c->adds;
+    removes += c->removes;
+    nulls += c->nulls;
+    bytes += c->block_bytes;
+    cpu += c->cpu_ns;
+    ticks += c->empty_ticks;
+    nodtlb |= c->dtlb_misses < 0;
+    dtlb += c->dtlb_misses;
+    nocache |= c->cache_misses < 0;
+    cache += c->cache_misses;
+    if (c->max_list > maxlist)
+      maxlist = c->max_list;
+    // Threads that only added are left out of the fairness figures
+    if (c->removes + c->nulls > 0) {
+      if (perThread != NULL)
+        perThread[consumers++] = c->removes;
+      if (now - c->last_remove_ticks > gap)
+        gap = now - c->last_remove_ticks;
+      if (c->max_remove_gap > gap)
+        gap = c->max_remove_gap;
+    }
+  }
+
+  result->num_CASSuccess = cassuc;
+  result->num_CASFail = casfail;
+  result->num_Steal = steal;
+  result->max_list_length = maxlist;
+  result->bytes_per_item = adds > 0 ? (float)bytes / adds : 0;
+  result->dtlb_misses = nodtlb ? -1 : dtlb;
+  result->cache_misses = nocache ? -1 : cache;
+  result->cpu_ns = cpu;
+  result->num_removed = removes;
+  result->num_null = nulls;
+  result->empty_ns = ticks / ClockTicksPerNs();
+  Fairness(perThread, consumers, &result->remove_jain,
+           &result->remove_max_min);
+  result->max_gap_ns = gap / ClockTicksPerNs();
+  free(perThread);
+}
+
+// Items are tagged as (producer << TAG_SHIFT | sequence) + 1, so they are
+// never NULL and can be traced back to exactly one add without allocating.
+#define TAG_SHIFT 40
+
+// Marks a removed item in its producer's bitmap. Returns false if the item
+// was delivered before or does not decode to an item that was ever added.
+static bool MarkSeen(uint64_t _Atomic **seen, int num_threads, long words,
+                     void *item) {
+  uint64_t tag = (uintptr_t)item - 1;
+  uint64_t producer = tag >> TAG_SHIFT;
+  uint64_t seq = tag & ((1ull << TAG_SHIFT) - 1);
+  if (producer >= (uint64_t)num_threads || seq / 64 >= (uint64_t)words)
+    return false;
+  uint64_t bit = 1ull << (seq % 64);
+  return (atomic_fetch_or(&seen[producer][seq / 64], bit) & bit) == 0;
+}
+
+// Adds completed and removes started by all threads, for check_empty
+static long _Atomic addsDone, removesStarted;
+
+// Removes an item for RunValidate. A NULL return is a false empty if the
+// adds completed before the call outnumber the removes, other than this
+// one, that started before it ended: their items were all in the bag.
+static void *Remove(const struct bag_ops *bag, bool check_empty,
+                    long *false_empty) {
+  if (!check_empty)
+    return bag->remove();
+  long added = atomic_load(&addsDone);
+  atomic_fetch_add(&removesStarted, 1);
+  void *item = bag->remove();
+  if (item == NULL && added > atomic_load(&removesStarted) - 1)
+    (*false_empty)++;
+  return item;
+}
+
+struct validate_result RunValidate(const struct bag_ops *bag,
+                                   void (*add_pri)(void *item, int lane),
+                                   int num_lanes, int num_threads,
+                                   long num_ops, bool check_empty) {
+  // Every thread randomly adds uniquely tagged items, 1 in 8 of them to a
+  // priority lane if there are any, or removes, then all threads drain the
+  // bag. Odd threads add 3 in 4 times and even ones 1 in 4 times, so that
+  // lists grow on some threads and others run dry and steal, share or
+  // wait. Each producer owns a bitmap indexed by sequence number in which
+  // consumers mark the items they got, so a duplicate shows up as an
+  // already set bit and a lost item as a bit that is still clear.
+  struct validate_result result;
+  long ops_per_thread = num_ops / num_threads;
+  long words = ops_per_thread / 64 + 1;
+  uint64_t _Atomic **seen = calloc(num_threads, sizeof(*seen));
+  long *added = calloc(num_threads, sizeof(long));
+  long removed = 0, duplicated = 0, false_empty = 0;
+  double tic, toc;
+
+  if (seen == NULL || added == NULL) {
+    fprintf(stderr, "validate: cannot allocate %d bitmaps\n", num_threads);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    seen[i] = calloc(words, sizeof(uint64_t));
+    if (seen[i] == NULL) {
+      fprintf(stderr, "validate: cannot allocate %ld bitmap words\n", words);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  addsDone = 0;
+  removesStarted = 0;
+  omp_set_num_threads(num_threads);
+  bag->init_bag(num_threads);
+
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads)                                 \
+    reduction(+ : removed, duplicated, false_empty)
+  {
+    int id = omp_get_thread_num();
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (id + 1);
+    long seq = 0;
+    void *item;
+    bag->init_thread(id);
+
+#pragma omp barrier
+
+    for (long j = 0; j < ops_per_thread; j++) {
+      uint64_t r = XorShift(&rng);
+      if (id % 2 ? (r & 3) != 0 : (r & 3) == 0) {
+        item = (void *)((((uintptr_t)id << TAG_SHIFT) | seq) + 1);
+        if (add_pri != NULL && num_lanes > 1 && (r >> 2) % 8 == 0)
+          add_pri(item, 1 + (r >> 5) % (num_lanes - 1));
+        else
+          bag->add(item);
+        if (check_empty)
+          atomic_fetch_add(&addsDone, 1);
+        seq++;
+      } else if ((item = Remove(bag, check_empty, &false_empty)) != NULL) {
+        removed++;
+        duplicated += !MarkSeen(seen, num_threads, words, item);
+      }
+    }
+    added[id] = seq;
+
+    // No add runs after this barrier, so NULL really means empty.
+#pragma omp barrier
+
+    while ((item = Remove(bag, check_empty, &false_empty)) != NULL) {
+      removed++;
+      duplicated += !MarkSeen(seen, num_threads, words, item);
+    }
+  }
+  toc = omp_get_wtime();
+
+  long total_added = 0, delivered = 0;
+  for (int i = 0; i < num_threads; i++) {
+    total_added += added[i];
+    for (long w = 0; w < words; w++)
+      delivered += __builtin_popcountll(seen[i][w]);
+    free(seen[i]);
+  }
+  free(seen);
+  free(added);
+
+  result.time = toc - tic;
+  result.num_ops = ops_per_thread * num_threads;
+  result.num_added = total_added;
+  result.num_removed = removed;
+  result.num_lost = total_added - delivered;
+  result.num_duplicated = duplicated;
+  result.num_false_empty = false_empty;
+  return result;
+}
@@ -0,0 +1,76 @@
+// Result layout and bookkeeping shared by the benchmark entry points of the
+// full bag, the simple bag and the queue, so that benchmark.py reads all of
+// them through the same ctypes structures.
+#pragma once
+
+#include "workload.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct bench_result {
+  float time;
+  int num_items;
+  int num_CASSuccess;
+  int num_CASFail;
+  int num_Steal;
+  int max_list_length;
+  float bytes_per_item;
+  long dtlb_misses;
+  long cache_misses;
+  long cpu_ns;      // CPU time of all threads
+  long num_removed; // Successful TryRemoveAny calls
+  long num_null;    // TryRemoveAny calls that returned NULL
+  long empty_ns;    // ... time they spent after finding the own list empty
+  // Fairness among the threads that called TryRemoveAny: Jain index and
+  // largest over smallest of their successful removes, and the longest any
+  // of them went without one, up to the end of the run
+  double remove_jain;
+  double remove_max_min;
+  long max_gap_ns;
+};
+
+// What one thread counted during a benchmark, gathered by the bag from its
+// thread-local variables
+struct thread_counters {
+  long cas_success;
+  long cas_fail;
+  long steal;
+  long adds;
+  long removes;
+  long nulls;
+  long block_bytes; // Bytes of blocks allocated for the adds
+  long max_list;    // Longest own list, in blocks
+  long cpu_ns;
+  long dtlb_misses;  // -1 if not available
+  long cache_misses; // -1 if not available
+  uint64_t empty_ticks;       // ClockTicks spent in removes that found nothing
+  uint64_t last_remove_ticks; // ClockTicks at the last successful remove
+  uint64_t max_remove_gap;    // Longest ClockTicks between two of them
+};
+
+// Sums up the counters of num_threads threads into result, all but time
+// and num_items
+void FillCounters(struct bench_result *result,
+                  const struct thread_counters *counters, int num_threads);
+
+struct validate_result {
+  float time;
+  long num_ops;
+  long num_added;
+  long num_removed;
+  long num_lost;
+  long num_duplicated;
+  long num_false_empty; // Removes that returned NULL with items surely present
+};
+
+// Checks that every added item is removed exactly once, with num_ops random
+// adds and removes spread over num_threads threads. If add_pri is not NULL,
+// some items go to its lanes 1 to num_lanes - 1 instead of bag->add. With
+// check_empty it also counts removes that returned NULL although more adds
+// had completed before the call than removes were started until its end.
+// The two shared counters this takes serialise the threads somewhat.
+struct validate_result RunValidate(const struct bag_ops *bag,
+                                   void (*add_pri)(void *item, int lane),
+                                   int num_lanes, int num_threads,
+                                   long num_ops, bool check_empty);
@@ -1,8 +1,12 @@
 #include "concurrentBags.h"
 #include "memoryManagement.h"
 #include "config.h"
+#include "bench.h"
+#include "workload.h"
 
+#include <omp.h>
 #include <stdatomic.h> // gcc -latomic
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
@@ -22,6 +26,10 @@
 #define FAO(_a, _e) atomic_fetch_or_explicit(_a, _e, memory_order_acq_rel)
 #endif
 
+// Fixed block size of the paper. MAX_BLOCK_SIZE in config.h only bounds how
+// far the simple bag grows its blocks.
+#define BLOCK_SIZE 32
+
 #define UNMARK_MASK ~0b11
 #define MARK_BIT1 0b01
 #define MARK_BIT2 0b10
@@ -33,24 +41,41 @@
 #define setmark2(_markedpointer) ((block_t *)(((long)_markedpointer) | MARK_BIT2))
 
 
+// Initialization variables
+int Nr_threads;
 // Shared variables
 block_t * _Atomic globalHeadBlock[MAX_NR_THREADS];
+// Blocks unlinked by thread i, freed by the next InitBag (see DeleteNode)
+block_t *retiredBlocks[MAX_NR_THREADS];
 
-volatile block_t *threadBlock, *stealBlock, *stealPrev;
+block_t *threadBlock, *stealBlock, *stealPrev;
 bool foundAdd;
 int threadHead, stealHead, stealIndex;
 int threadID; // Unique number between 0 ... Nr_threads
-
-#pragma omp threadprivate(threadBlock, stealBlock, stealPrev, foundAdd, threadHead, stealHead, stealIndex, threadID)
+int numCASSuccess, numCASFail, numSteal;
+// Blocks in this thread's list as far as the owner knows: blocks unlinked
+// by thieves are only noticed when the owner reaches them
+int listLength, maxListLength;
+long numAdd, numBlockBytes;
+long numRemove, numNull; // Successful and empty TryRemoveAny calls
+uint64_t emptyTicks;     // ClockTicks the empty ones spent stealing
+long cpuStartNs;         // ThreadCpuNs at InitThread
+uint64_t lastRemoveTicks; // ClockTicks at the last successful TryRemoveAny
+uint64_t maxRemoveGap;    // Longest time between two of them
+
+#pragma omp threadprivate(threadBlock, stealBlock, stealPrev, foundAdd, threadHead, stealHead, stealIndex, threadID, \
+                          numCASSuccess, numCASFail, numSteal, listLength, maxListLength, numAdd, numBlockBytes, \
+                          numRemove, numNull, emptyTicks, cpuStartNs, lastRemoveTicks, maxRemoveGap)
 
 struct block_t
 {
-    DT * _Atomic nodes[MAX_BLOCK_SIZE]; // changed void*
-    long _Atomic notifyAdd[MAX_NR_THREADS / WORD_SIZE];
+    DT * _Atomic nodes[BLOCK_SIZE]; // changed void*
+    unsigned long _Atomic notifyAdd[(MAX_NR_THREADS + WORD_SIZE - 1) / WORD_SIZE];
     /* Attention! Also holds marked1 and marked2 in its lsb
     Therefore have to mask when actually dereferencing the pointer
     */
     block_t* _Atomic next;
+    block_t *nextRetired; // Link in retiredBlocks once unlinked
 };
 
 void Mark1Block(block_t *block)
@@ -74,38 +99,56 @@ void NotifyAll(block_t *block)
         block->notifyAdd[i] = 0;
 }
 
-block_t* _Atomic NewBlock()
+block_t *NewBlock()
 {
     block_t* _Atomic block = NewNode();
     block_t* work = block;
     NotifyAll(work);
-    for (int i = 0; i < MAX_BLOCK_SIZE; i++)
+    for (int i = 0; i < BLOCK_SIZE; i++)
         work->nodes[i] = NULL;
+    numBlockBytes += sizeof(block_t);
     return block;
 }
 
 void NotifyStart(block_t *block, int Id)
 {
-    long old;
+    unsigned long old;
+    numCASFail--;
     do
     {
         old = block->notifyAdd[Id / WORD_SIZE];
-    } while (!CAS(&block->notifyAdd[Id / WORD_SIZE], &old, old | (1 << (Id % WORD_SIZE))));
+        numCASFail++;
+    } while (!CAS(&block->notifyAdd[Id / WORD_SIZE], &old, old | (1UL << (Id % WORD_SIZE))));
+    numCASSuccess++;
 }
 
 bool NotifyCheck(block_t *block, int Id)
 {
-    return (block->notifyAdd[Id / WORD_SIZE] & (1 << (Id % WORD_SIZE))) == 0;
+    return (block->notifyAdd[Id / WORD_SIZE] & (1UL << (Id % WORD_SIZE))) == 0;
 }
 
 void InitBag(int num_threads)
 {
-    /*
-    Nr_threads = num_threads;
-    block_t* hb[MAX_NR_THREADS];
-    globalHeadBlock = hb;
-    */
+    // The lists of a previous bag can be freed, no thread is using it anymore
     for (int i = 0; i < MAX_NR_THREADS; i++)
+    {
+        block_t *block = getpointer(globalHeadBlock[i]);
+        while (block != NULL)
+        {
+            block_t *next = getpointer(block->next);
+            free(block);
+            block = next;
+        }
+        globalHeadBlock[i] = NULL;
+        while (retiredBlocks[i] != NULL)
+        {
+            block_t *next = retiredBlocks[i]->nextRetired;
+            free(retiredBlocks[i]);
+            retiredBlocks[i] = next;
+        }
+    }
+    Nr_threads = num_threads;
+    for (int i = 0; i < Nr_threads; i++)
         globalHeadBlock[i] = NewBlock();
 }
 
@@ -113,11 +156,24 @@ void InitThread(int id)
 {
     threadID = id;
     threadBlock = globalHeadBlock[threadID];
-    threadHead = MAX_BLOCK_SIZE;
+    threadHead = BLOCK_SIZE;
     stealIndex = 0;
     stealBlock = (block_t *)NULL;
     stealPrev = (block_t *)NULL;
-    stealHead = MAX_BLOCK_SIZE;
+    stealHead = BLOCK_SIZE;
+    numCASSuccess = 0;
+    numCASFail = 0;
+    numSteal = 0;
+    listLength = 1;
+    maxListLength = 1;
+    numAdd = 0;
+    numBlockBytes = 0;
+    numRemove = 0;
+    numNull = 0;
+    emptyTicks = 0;
+    cpuStartNs = ThreadCpuNs();
+    lastRemoveTicks = ClockTicks();
+    maxRemoveGap = 0;
 }
 
 void Add(void *item)
@@ -126,7 +182,7 @@ void Add(void *item)
     block_t *block = threadBlock;
     for (;;)
     {
-        if (head == MAX_BLOCK_SIZE)
+        if (head == BLOCK_SIZE)
         {
             block_t *oldblock = block;
             block = NewBlock();
@@ -135,12 +191,15 @@ void Add(void *item)
             globalHeadBlock[threadID] = block;
             threadBlock = block;
             head = 0;
+            if (++listLength > maxListLength)
+                maxListLength = listLength;
         }
         else if (block->nodes[head] == NULL)
         {
             NotifyAll(block);
             block->nodes[head] = item;
             threadHead = head + 1;
+            numAdd++;
             return;
         }
         else
@@ -148,9 +207,9 @@ void Add(void *item)
     }
 }
 
-block_t *NextStealBlock(volatile block_t *block)
+block_t *NextStealBlock(block_t *block)
 {
-    volatile block_t* next;
+    block_t* next;
     for (;;)
     {
         if (block == NULL)
@@ -188,7 +247,8 @@ block_t *NextStealBlock(volatile block_t *block)
                 block_t* copy = stealPrev->next;
                 block_t* prevnext = (block_t*)getpointer(block);
                 if (ismarked2(copy)) prevnext = setmark2(prevnext);
-                block_t* new = (block_t*){next};
+                // Only block is deleted, stealPrev must not inherit its mark
+                block_t* new = getpointer(next);
                 
                 if (CAS(&stealPrev->next, &prevnext, new))
                 {
@@ -205,7 +265,9 @@ block_t *NextStealBlock(volatile block_t *block)
             }
             else if (block == stealBlock)
             {
-                block_t* value = setmark1(getpointer(block));
+                // mark2 announces that the next block goes, mark1 would
+                // delete stealPrev itself
+                block_t* value = setmark2(getpointer(block));
                 block_t* expect = getpointer(block);
                 if (CAS(&stealPrev->next, &expect, value))
                 {
@@ -243,14 +305,14 @@ void *TryStealBlock(int round)
         stealBlock = block;
         stealHead = head = 0;
     }
-    if (head == MAX_BLOCK_SIZE)
+    if (head == BLOCK_SIZE)
     {
         stealBlock = block = NextStealBlock(block);
         head = 0;
     }
     if (block == NULL)
     {
-        stealIndex = (stealIndex + 1) % MAX_NR_THREADS;
+        stealIndex = (stealIndex + 1) % Nr_threads;
         stealHead = 0;
         stealBlock = NULL;
         stealPrev = NULL;
@@ -262,7 +324,7 @@ void *TryStealBlock(int round)
         foundAdd = true;
     for (;;)
     {
-        if (head >= MAX_BLOCK_SIZE)
+        if (head >= BLOCK_SIZE)
         {
             stealHead = head;
             return NULL;
@@ -274,13 +336,26 @@ void *TryStealBlock(int round)
                 head++;
             else if (CAS(&block->nodes[head], &data, NULL))
             {
+                numCASSuccess++;
                 stealHead = head;
                 return data;
             }
+            else
+                numCASFail++;
         }
     }
 }
 
+// Accounts a successful TryRemoveAny, for the fairness report
+static inline void CountRemove()
+{
+    uint64_t now = ClockTicks();
+    if (now - lastRemoveTicks > maxRemoveGap)
+        maxRemoveGap = now - lastRemoveTicks;
+    lastRemoveTicks = now;
+    numRemove++;
+}
+
 void *TryRemoveAny()
 {
     int head = threadHead - 1;
@@ -290,14 +365,19 @@ void *TryRemoveAny()
     {
         if (block == NULL || (head < 0 && getpointer(DeRefLink(&block->next)) == NULL))
         {
+            uint64_t emptyStart = ClockTicks();
             do
             {
                 int i = 0;
                 do
                 {
+                    numSteal++;
                     void *result = TryStealBlock(round);
                     if (result != NULL)
+                    {
+                        CountRemove();
                         return result;
+                    }
                     if (foundAdd)
                     {
                         round = 0;
@@ -305,14 +385,17 @@ void *TryRemoveAny()
                     }
                     else if (stealBlock == NULL)
                         i++;
-                } while (i < MAX_NR_THREADS);
-            } while (++round <= MAX_NR_THREADS);
+                } while (i < Nr_threads);
+            } while (++round <= Nr_threads);
+            numNull++;
+            emptyTicks += ClockTicks() - emptyStart;
             return NULL;
         }
         if (head < 0)
         {
             Mark1Block(block);
-            for (;;)
+            // Unlinking a marked last block leaves the own list empty
+            while (block != NULL)
             {
                 block_t* next = DeRefLink(&block->next);
                 if (ismarked2(next))
@@ -320,14 +403,15 @@ void *TryRemoveAny()
                 if (ismarked1(next))
                 {
                     if (getpointer(next)!=NULL)
-                        NotifyAll(next); //Dropping flags ???
+                        NotifyAll(getpointer(next));
                     if (CAS(&globalHeadBlock[threadID],
                             &block, getpointer(next)))
                     {
                         block->next = (block_t*)setmark1(NULL);
                         DeleteNode(block);
                         ReScan(next);
-                        block = next;
+                        block = getpointer(next);
+                        listLength--;
                     }
                     else
                         block = DeRefLink(&globalHeadBlock
@@ -337,8 +421,8 @@ void *TryRemoveAny()
                     break;
             }
             threadBlock = block;
-            threadHead = MAX_BLOCK_SIZE;
-            head = MAX_BLOCK_SIZE - 1;
+            threadHead = BLOCK_SIZE;
+            head = BLOCK_SIZE - 1;
         }
         else
         {
@@ -347,16 +431,20 @@ void *TryRemoveAny()
                 head--;
             else if (CAS(&block->nodes[head], &data, NULL))
             {
+                numCASSuccess++;
                 threadHead = head;
+                CountRemove();
                 return data;
             }
+            else
+                numCASFail++;
         }
     }
 }
 
 //-------------Memory Management-----------------
 
-block_t* _Atomic NewNode(void)
+block_t *NewNode(void)
 {
     block_t* _Atomic new = (block_t* _Atomic)malloc(sizeof(block_t));
     block_t* work = new;
@@ -365,9 +453,14 @@ block_t* _Atomic NewNode(void)
     return new;
 };
 
+// There are no hazard pointers: a thief may still read the slots and next
+// pointer of a block after another thread unlinked it. Unlinked blocks are
+// therefore only freed once no thread uses the bag, by the next InitBag, so
+// memory grows with the number of blocks a run drains.
 void DeleteNode(block_t *node)
 {
-    // TODO ?
+    node->nextRetired = retiredBlocks[threadID];
+    retiredBlocks[threadID] = node;
 };
 
 block_t *DeRefLink(struct block_t * _Atomic* link) { 
@@ -381,112 +474,173 @@ void ReScan(block_t* _Atomic node) {
     LOAD(&node);
 };
 
-#include <omp.h>
-#include <stdio.h>
-#include <stdlib.h>
+//-------------Benchmarks-----------------
+// Same entry points and result layout as concurrentBagsSimple.c, so that
+// benchmark.py can run the full and the simple bag side by side.
 
-int main(int argc, char * argv[]) {
-    double tic, toc;
-    int threads;
-    if (argc == 2)
+// Sums up the thread-local counters of all threads into result. Relies on
+// every thread running exactly one iteration, as in the benchmarks.
+void CollectCounters(struct bench_result *result, int num_threads)
+{
+    struct thread_counters counters[MAX_NR_THREADS];
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads; i++)
     {
-        threads = (int)strtol(argv[1], NULL, 10);
-    } else threads = 10;
-
-    printf("Running with %d threads\r\n", threads);
+        counters[threadID] = (struct thread_counters){
+            .cas_success = numCASSuccess,
+            .cas_fail = numCASFail,
+            .steal = numSteal,
+            .adds = numAdd,
+            .removes = numRemove,
+            .nulls = numNull,
+            .block_bytes = numBlockBytes,
+            .max_list = maxListLength,
+            .cpu_ns = ThreadCpuNs() - cpuStartNs,
+            // Hardware counters are only collected by the simple bag
+            .dtlb_misses = -1,
+            .cache_misses = -1,
+            .empty_ticks = emptyTicks,
+            .last_remove_ticks = lastRemoveTicks,
+            .max_remove_gap = maxRemoveGap,
+        };
+    }
+    FillCounters(result, counters, num_threads);
+}
 
-    
-    InitBag(threads);
+struct bench_result benchmark_add_remove(int num_threads, int num_elems)
+{
+    // First add num_elems elements per thread and then remove them again
+    struct bench_result result;
+    double tic, toc;
 
-    omp_set_num_threads(threads);
+    omp_set_num_threads(num_threads);
+    InitBag(num_threads);
 
     tic = omp_get_wtime();
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads; i++)
+        InitThread(omp_get_thread_num());
 
-    /*
     #pragma omp parallel for
-    for (int i = 0; i < omp_get_num_threads(); i++)
+    for (int i = 0; i < num_threads; i++)
     {
-        int id = omp_get_thread_num();
-        InitThread(id);
+        int val = omp_get_thread_num();
+        for (int j = 0; j < (int)(num_elems / (num_threads * 2)); j++)
+            Add(&val);
+        for (int j = 0; j < (int)(num_elems / (num_threads * 2)); j++)
+            TryRemoveAny();
     }
-    for (int i = 0; i < omp_get_num_threads(); i++)
+    toc = omp_get_wtime();
+
+    CollectCounters(&result, num_threads);
+    result.time = toc - tic;
+    result.num_items = num_threads * (int)(num_elems / num_threads);
+    return result;
+}
+
+struct bench_result benchmark_random(int num_threads, int num_elems)
+{
+    struct bench_result result;
+    double tic, toc;
+    srand(1);
+
+    omp_set_num_threads(num_threads);
+    InitBag(num_threads);
+
+    tic = omp_get_wtime();
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads; i++)
+        InitThread(omp_get_thread_num());
+
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads; i++)
     {
-        int id = omp_get_thread_num();
-        if (id == 0)
-        {
-            int *item = malloc(sizeof(int));
-            *item = id;
-            Add(item);
-        } else
+        int val = omp_get_thread_num();
+        for (int j = 0; j < (int)(num_elems / num_threads); j++)
         {
-            int *result = (int*)TryRemoveAny();
-            if (result == NULL)
-            {
-                 printf("Bag was empty\r\n");
-            } else
-            printf("Received %d\r\n", *result);
+            if ((float)rand() / (float)(RAND_MAX) < 0.5)
+                Add(&val);
+            else
+                TryRemoveAny();
         }
-        
-        
     }
-    */
+    toc = omp_get_wtime();
+
+    CollectCounters(&result, num_threads);
+    result.time = toc - tic;
+    result.num_items = num_threads * (int)(num_elems / num_threads);
+    return result;
+}
 
-    long genresult = 0;
-    int multiply = 10;
-
-    // #pragma omp parallel for private(thread) shared(threads)
-    // for (int i = 0; i < threads; i++)
-    // {
-    //     int id = omp_get_thread_num();        
-    //     thread = InitThread(id);
-    //     threadar[id] = thread;        
-    //     printf("Hello from thread %d\r\n", id + 1);
-    // }
-    
-    
-    #pragma omp parallel for reduction(+:genresult) shared(globalHeadBlock)
-    for (int i = 0; i < omp_get_num_threads(); i++)
+// Threads for which producer(thread) holds add, all others remove
+static struct bench_result ProducersConsumers(int num_threads, int num_elems, bool (*producer)(int, int))
+{
+    struct bench_result result;
+    double tic, toc;
+
+    omp_set_num_threads(num_threads);
+    InitBag(num_threads);
+
+    tic = omp_get_wtime();
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads; i++)
+        InitThread(omp_get_thread_num());
+
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads; i++)
     {
-        int id = omp_get_thread_num();
-        //thread = threadar[id];
-        InitThread(id);
-        printf("Hello from thread %d\r\n", id + 1);
-        int mult = multiply;
-        long result = 0;
-        int *inc = NULL;
-        
-        if (i < threads/2)
-        {
-        for (int j = 0; j < mult*(id+1); j++)
+        int val = omp_get_thread_num();
+        if (producer(val, num_threads))
         {
-            int *item = malloc(sizeof(int));
-            *item = id + 1;
-            Add(item);
+            for (int j = 0; j < (int)(num_elems / num_threads); j++)
+                Add(&val);
         }
-        } else {
-        
-        do
+        else
         {
-            inc = (int*)(TryRemoveAny());
-            if (inc != (int*)NULL) {
-                result += (long)*inc;
-                genresult += (long)*inc;
-            }
-        } while (inc != NULL);
-        printf("Thread %d got result %ld\r\n", id + 1, result);
+            for (int j = 0; j < (int)(num_elems / num_threads); j++)
+                TryRemoveAny();
         }
-                
     }
-    long expected = 0;
-    for (int i = 0; i < threads/2; i++)
-    {
-        expected += multiply*(i+1)*(i+1);
-    }
-    
-    printf("Got %ld overall, from %ld possible\r\n", genresult, expected);
-    
-        
     toc = omp_get_wtime();
 
-    printf("Unit test took %lf seconds \r\n", toc - tic);
-} 
\ No newline at end of file
+    CollectCounters(&result, num_threads);
+    result.time = toc - tic;
+    result.num_items = num_threads * (int)(num_elems / num_threads);
+    return result;
+}
+
+static bool UpperHalf(int id, int num_threads) { return id > num_threads / 2; }
+
+static bool OnlyFirst(int id, int num_threads) { (void)num_threads; return id == 0; }
+
+static bool AllButFirst(int id, int num_threads) { (void)num_threads; return id != 0; }
+
+struct bench_result benchmark_half_half(int num_threads, int num_elems)
+{
+    return ProducersConsumers(num_threads, num_elems, UpperHalf);
+}
+
+struct bench_result benchmark_one_producer(int num_threads, int num_elems)
+{
+    return ProducersConsumers(num_threads, num_elems, OnlyFirst);
+}
+
+struct bench_result benchmark_one_consumer(int num_threads, int num_elems)
+{
+    return ProducersConsumers(num_threads, num_elems, AllButFirst);
+}
+
+// Runs a phased workload (see workload.h) against this bag
+void benchmark_workload(int num_threads, const struct workload_phase *phases, int num_phases, struct workload_result *result)
+{
+    const struct bag_ops bag = {InitBag, InitThread, Add, TryRemoveAny};
+    RunWorkload(&bag, num_threads, phases, num_phases, result);
+}
+
+// Checks exactly-once delivery with RunValidate (see bench.h). The full
+// bag has no priority lanes.
+struct validate_result benchmark_validate(int num_threads, long num_ops)
+{
+    const struct bag_ops bag = {InitBag, InitThread, Add, TryRemoveAny};
+    return RunValidate(&bag, NULL, 1, num_threads, num_ops, false);
+}
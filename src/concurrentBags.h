@@ -1,3 +1,5 @@
+#include "bench.h"
+
 typedef struct block_t block_t;
 typedef struct  TLS_t TLS_t;
 // Thread-local storage
@@ -11,4 +13,8 @@ void InitThread(int id);
 void Add(void *item);
 void *TryRemoveAny();
 
+// Checks that every added item is removed exactly once, with num_ops random
+// Adds and TryRemoveAny calls spread over num_threads threads
+struct validate_result benchmark_validate(int num_threads, long num_ops);
+
 
@@ -1,18 +1,36 @@
 #include "concurrentBagsSimple.h"
+#include "bench.h"
 #include "config.h"
+#include "trace.h"
+#include "workload.h"
 
 #include <inttypes.h>
+#include <linux/membarrier.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
 #include <omp.h>
+#include <sched.h>
 #include <stdatomic.h> // gcc -latomic
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef SC
 #define CAS(_a, _e, _d) atomic_compare_exchange_weak(_a, _e, _d)
 #define LOAD(_a) atomic_load(_a)
 #define STORE(_a, _e) atomic_store(_a, _e)
 #define FAO(_a, _e) atomic_fetch_or(_a, _e)
+#define LINK_LOAD(_a) __atomic_load_n(_a, __ATOMIC_SEQ_CST)
+#define LINK_STORE(_a, _e) __atomic_store_n(_a, _e, __ATOMIC_SEQ_CST)
 #else
 #define CAS(_a, _e, _d)                                                        \
   atomic_compare_exchange_weak_explicit(_a, _e, _d, memory_order_acq_rel,      \
@@ -20,114 +38,1324 @@
 #define LOAD(_a) atomic_load_explicit(_a, memory_order_acquire)
 #define STORE(_a, _e) atomic_store_explicit(_a, _e, memory_order_release)
 #define FAO(_a, _e) atomic_fetch_or_explicit(_a, _e, memory_order_acq_rel)
+// The next and prev links of blocks are plain pointers. Where a thread links
+// a block into a list another thread walks, it publishes the link with
+// LINK_STORE, and the walkers read it with LINK_LOAD.
+#define LINK_LOAD(_a) __atomic_load_n(_a, __ATOMIC_ACQUIRE)
+#define LINK_STORE(_a, _e) __atomic_store_n(_a, _e, __ATOMIC_RELEASE)
 #endif
 
+// Block capacities are powers of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+#define NUM_SIZE_CLASSES 16
+#define SIZE_CLASS(_capacity) __builtin_ctz((_capacity) / MIN_BLOCK_SIZE)
+#define BLOCK_BYTES(_capacity) (sizeof(block_t) + (_capacity) * sizeof(DT *))
+// Retired blocks a thread collects before it tries to reclaim them
+#define RECLAIM_THRESHOLD 64
+// Arena chunks are huge-page sized and aligned
+#define CHUNK_SIZE (2L << 20)
+
+// Hardware events counted per thread during the benchmarks
+enum { PERF_DTLB_MISSES, PERF_CACHE_MISSES, NUM_PERF_EVENTS };
+
+// Where thieves start walking a victim's list
+enum { STEAL_HOT, STEAL_COLD };
+
+// How a thread waits before it retries after a failed CAS or steal round
+enum { BACKOFF_NONE, BACKOFF_EXPONENTIAL, BACKOFF_ADAPTIVE };
+#define BACKOFF_MIN 4    // Pause instructions in the first wait
+#define BACKOFF_MAX 4096 // Cap on pause instructions per wait
+
 // Initialization variables
 int Nr_threads;
+// Let the owner remove from its own blocks without a CAS per item
+bool ownerFastPath = true;
+// Pooled block bytes each thread keeps for reuse, the rest is freed
+long poolHighWater = 1 << 20;
+// Trim the own list whenever the owner allocates a block or runs dry
+bool autoTrim = false;
+// Compact the own list every compactBlocks new blocks once it is longer
+// than that, 0 (default) only compacts on Compact()
+int compactBlocks = 0;
+// Carve blocks from per-thread huge-page chunks instead of malloc
+bool useArena = false;
+// STEAL_HOT starts at the owner's newest block, STEAL_COLD at its oldest
+int stealMode = STEAL_HOT;
+int backoffPolicy = BACKOFF_NONE;
+// Give up the core between empty steal rounds, for oversubscribed runs
+bool yieldOnEmpty = false;
+// Direct steals and detect an empty bag with the nonEmpty summary. Off
+// (default) until its cache and CAS traffic is measured on a large machine.
+bool useSummary = false;
+// Set if membarrier(2) can be used to order summary clears against Add
+bool summaryBarrier = false;
+// Work sharing: a thread with more blocks than this hands its oldest ones
+// to idle threads. 0 (default) leaves balancing to the thieves.
+int shareThreshold = 0;
+// Elimination: slots in which consumers with an empty list wait for a
+// concurrent Add to hand over its item directly. 0 (default) disables it.
+int elimSlots = 0;
+// Steal domains: runs of domainSize consecutive thread ids, which share a
+// last level cache if threads are pinned in order (OMP_PROC_BIND=close).
+// Thieves look for work in their own domain before the others. The size
+// asked for with SetStealDomains, 0 (default) derives it from the caches.
+int stealDomainSize = 0;
+int domainSize = 64, numDomains = 1;
 // Shared variables
 block_t * globalHeadBlock[MAX_NR_THREADS];
+block_t * globalTailBlock[MAX_NR_THREADS]; // Oldest block of each list
+// Epoch based reclamation: a retired block is freed once every thread has
+// announced an epoch later than the one it was retired in.
+long _Atomic globalEpoch = 1;
+struct {
+  long _Atomic epoch;
+  char pad[64 - sizeof(long)];
+} threadEpoch[MAX_NR_THREADS];
+// One bit per thread, set by the owner after it added to an unflagged list
+// and cleared lazily by thieves that find the list empty. The bits of a
+// domain share a word, and a domain is flagged in nonEmptyDomains while any
+// of its threads may be. Every item whose Add has completed is in a
+// flagged list of a flagged domain, except while a clear is in progress.
+// summaryVersion grows by 2 whenever a bit is set and is odd while a thief
+// clears one, so an unchanged even version around a scan that saw no bits
+// proves the bag was empty when the scan started.
+struct {
+  uint64_t _Atomic bits;
+  char pad[64 - sizeof(uint64_t)];
+} nonEmpty[MAX_NR_THREADS];
+_Alignas(64) uint64_t _Atomic nonEmptyDomains[(MAX_NR_THREADS + 63) / 64];
+_Alignas(64) long _Atomic summaryVersion;
+// Odd while some owner compacts. The survivors Compact moves are in no list
+// until it stores them again, so an empty verdict only stands if this did
+// not change during the scans.
+_Alignas(64) long _Atomic compactVersion;
+// Tickets of the membarrier(2) calls MarkStolen started, and the highest one
+// completed, so that thieves marking blocks at the same time share a call
+_Alignas(64) long _Atomic barriersStarted;
+_Alignas(64) long _Atomic barriersDone;
+// Consumers blocked in RemoveOrWait, oldest first, guarded by waiterLock.
+// Add only reads numWaiters unless someone is waiting. The state word of a
+// queued waiter is claimed with a CAS, by the Add that hands it an item or
+// by RemoveOrWait itself when its retry finds one. While RemoveOrWait still
+// runs (WAITER_BUSY) an Add only leaves the item in the waiter
+// (WAITER_HANDED) for RemoveOrWait to return, as resume may free it.
+_Alignas(64) long _Atomic numWaiters;
+_Alignas(64) atomic_flag waiterLock = ATOMIC_FLAG_INIT;
+struct bag_waiter *waiterHead, *waiterTail;
+#define WAITER_QUEUED 0
+#define WAITER_CLAIMED 1   // An Add is handing it an item
+#define WAITER_CANCELLED 2 // RemoveOrWait found an item after all
+#define WAITER_BUSY 4
+#define WAITER_HANDED 8
+// Readiness eventfd, or -1. readyArmed is set while the fd is clear and
+// the next Add has to signal it; the Add that resets it writes the fd.
+int readyFd = -1;
+_Alignas(64) bool _Atomic readyArmed = true;
+long _Atomic readyWrites, readyReads; // Syscalls on readyFd
+// Work sharing: a thread whose own list ran dry advertises its drained head
+// block in its idle slot and sets its bit in idleThreads. A producer claims
+// the slot, links one of its blocks behind the drained one and marks the
+// slot IDLE_HANDED; the idle thread counts the block the next time it
+// touches its list. Until then it leaves the tail of its list alone.
+#define IDLE_CLAIMED ((block_t *)1)
+#define IDLE_HANDED ((block_t *)2)
+struct {
+  block_t *_Atomic block;
+  char pad[64 - sizeof(block_t *)];
+} idleSlot[MAX_NR_THREADS];
+_Alignas(64) uint64_t _Atomic idleThreads[(MAX_NR_THREADS + 63) / 64];
+// Elimination slots: NULL, ELIM_WAITING while a consumer waits in it, or
+// the item a producer handed over. The marker is an address no item can
+// have, small integers such as (void *)1 are valid items.
+static char elimWaiting;
+#define ELIM_WAITING ((void *)&elimWaiting)
+#define ELIM_SPINS 256 // Pause instructions a consumer waits in its slot
+struct {
+  void *_Atomic item;
+  char pad[64 - sizeof(void *)];
+} elimSlot[MAX_NR_THREADS];
+// Priority lanes 1 ... NUM_LANES - 1 above the ordinary lists of lane 0.
+// Every thread owns a chain of blocks per lane, newest first. A lane keeps
+// one summary bit per thread like nonEmpty, and lanesFlagged a bit per lane
+// that may have bits set, so TryRemoveAny pays one load while lanes are
+// unused. Setting and clearing lane bits moves summaryVersion as well.
+#define LANE_BLOCK_SIZE 64
+block_t *laneHeadBlock[NUM_LANES][MAX_NR_THREADS];
+struct {
+  _Alignas(64) uint64_t _Atomic bits[(MAX_NR_THREADS + 63) / 64];
+} laneNonEmpty[NUM_LANES];
+_Alignas(64) uint64_t _Atomic lanesFlagged;
+// Steal counters by thief and victim. Too large for static TLS at
+// MAX_NR_THREADS, so threads only keep pointers to their rows.
+long stealHitRows[MAX_NR_THREADS][MAX_NR_THREADS];
+long stealMissRows[MAX_NR_THREADS][MAX_NR_THREADS];
 // Thread-local storage
 block_t *threadBlock, *stealBlock;
 bool foundAdd;
 int threadHead, stealHead, stealIndex;
 int threadID; // Unique number between 0 ... Nr_threads
+int threadBlockSize; // Capacity of the next block this thread allocates
 int numCASSuccess, numCASFail, numSteal;
+int listLength, maxListLength; // Blocks in this thread's list
+long numAdd, numRemove, numBlockBytes;
+// Successful and failed TryStealBlock calls of this thread per victim, its
+// rows of stealHitRows and stealMissRows
+long *stealHits, *stealMisses;
+long localEpoch;
+block_t *limbo; // Retired blocks waiting for their grace period
+int limboCount;
+block_t *pool[NUM_SIZE_CLASSES]; // Reclaimed blocks by capacity
+long poolBytes;
+struct chunk_t *arenaChunk; // Chunk this thread currently carves from
+bool perfOpened;
+int perfFd[NUM_PERF_EVENTS];
+int casFailRate; // Recent CAS failure rate in 1/1024, for BACKOFF_ADAPTIVE
+block_t *advertised; // What this thread put in its idle slot, or NULL
+long numShared, numReceived; // Blocks handed to and adopted from others
+long numEliminated; // Items this thread's Add handed to a waiting consumer
+long numCompacted;  // Items moved out of sparse blocks
+int blocksSinceCompact;
+bool compacting;
+long numNull;        // TryRemoveAny calls that returned NULL
+uint64_t emptyTicks; // ClockTicks they spent in the empty path
+long cpuStartNs;     // ThreadCpuNs at InitThread
+bool rearming;       // Inside the TryRemoveAny that Rearm runs
+uint64_t lastRemoveTicks; // ClockTicks at the last successful TryRemoveAny
+uint64_t maxRemoveGap;    // Longest time between two of them
+// SummaryWord and SummaryBit of this thread, for Add
+uint64_t _Atomic *ownSummaryWord;
+uint64_t ownSummaryBit;
+block_t *laneBlock[NUM_LANES]; // Own newest block per lane
+int laneHead[NUM_LANES];       // Slot the next AddPri uses in it
 
 #pragma omp threadprivate(threadBlock, stealBlock, foundAdd, threadHead,       \
-                          stealHead, stealIndex, threadID, numCASSuccess,      \
-                          numCASFail, numSteal)
+                          stealHead, stealIndex, threadID, threadBlockSize,    \
+                          numCASSuccess, numCASFail, numSteal, listLength,     \
+                          maxListLength, numAdd, numRemove, numBlockBytes,     \
+                          stealHits, stealMisses, localEpoch, limbo,           \
+                          limboCount, pool, poolBytes, arenaChunk,             \
+                          perfOpened, perfFd, casFailRate, advertised,        \
+                          numShared, numReceived, numEliminated,              \
+                          numCompacted, blocksSinceCompact, compacting,       \
+                          ownSummaryWord, ownSummaryBit, laneBlock, laneHead, \
+                          numNull, emptyTicks, cpuStartNs, lastRemoveTicks,   \
+                          maxRemoveGap, rearming)
 
 struct block_t {
-  DT * nodes[MAX_BLOCK_SIZE]; // changed void*
-  long _Atomic notifyAdd[MAX_NR_THREADS / WORD_SIZE];
   block_t * next;
+  block_t * prev; // Towards the head, for thieves stealing from the tail
+  // Number of slots in nodes, between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+  int capacity;
+  // Set by NewNode if the block was carved from an arena chunk
+  bool fromArena;
+  // Slot the owner is currently taking without a CAS, or -1
+  int _Atomic ownerTake;
+  // UNSTOLEN until the first thief marks the block, see MarkStolen
+  int _Atomic stealState;
+  unsigned long _Atomic notifyAdd[(MAX_NR_THREADS + WORD_SIZE - 1) / WORD_SIZE];
+  // Links the block into the limbo list or pool once it is retired
+  block_t *retiredNext;
+  long retireEpoch;
+  DT * nodes[]; // changed void*
+};
+
+enum { UNSTOLEN, MARKING, STOLEN };
+
+// Header at the start of every arena chunk. Blocks are carved from a chunk
+// by bumping a pointer and only ever freed by the thread that carved them,
+// which is why ShareBlocks never hands them to another list.
+struct chunk_t {
+  char *bump;
+  int live;     // Blocks carved and not yet freed
+  bool current; // Some thread still carves from this chunk
+  bool huge;    // Backed by MAP_HUGETLB rather than transparent huge pages
+};
+
+struct oversub_result {
+  float time;
+  int num_items;
+  long num_null;        // TryRemoveAny calls that returned NULL
+  long num_false_empty; // ... while items added earlier were still present
+  long p50_ns;          // Latency percentiles of TryRemoveAny
+  long p99_ns;
+  long p999_ns;
+};
+
+struct eventfd_result {
+  float time;
+  int num_items;
+  long num_writes;       // write(2) calls on the readiness fd
+  long num_reads;        // read(2) calls on it, when rearming
+  long num_wakeups;      // epoll_wait calls of the consumer
+  long num_late_wakeups; // Timeouts after which items were found
+  long num_lost;         // Items left once the producers were done
+};
+
+struct sharing_result {
+  float time;
+  int num_items;
+  long num_steal;      // TryStealBlock calls
+  long num_steal_hits; // ... that returned an item
+  long num_shared;     // Blocks handed to idle threads
+  long p50_ns;         // Latency from Add to remove of an item
+  long p99_ns;
+  long p999_ns;
+};
+
+struct elim_result {
+  float time;
+  int num_items;
+  long num_eliminated; // Items handed from Add to TryRemoveAny directly
+  long num_steal;      // TryStealBlock calls
+  long num_null;       // TryRemoveAny calls that returned NULL
+};
+
+struct compact_result {
+  float time;         // Thieves draining the survivors
+  int num_items;      // Survivors
+  long blocks_before; // Blocks in all lists before compaction
+  long blocks_after;  // ... and after it
+  long compact_ns;    // Slowest owner's compaction pass
+  long steal_ns;      // Drain time per stolen item
+};
+
+struct lanes_result {
+  float time;
+  int num_items;
+  long num[NUM_LANES];     // Items per lane
+  long p50_ns[NUM_LANES];  // Latency from Add to remove per lane
+  long p99_ns[NUM_LANES];
+  long p999_ns[NUM_LANES];
+};
+
+// Primitives timed by benchmark_micro
+enum {
+  MICRO_ADD,           // Add into a block with room
+  MICRO_ADD_NEW_BLOCK, // Add that links a new block
+  MICRO_REMOVE,        // TryRemoveAny from the own head block
+  MICRO_RETIRE,        // ... that unlinks and retires the drained head first
+  MICRO_STEAL_WARM,    // Steal from the block the previous steal hit
+  MICRO_STEAL_COLD,    // Steal that had to find a new block or victim
+  MICRO_EMPTY,         // TryRemoveAny returning NULL on an empty bag
+  NUM_MICRO
+};
+
+struct micro_result {
+  long cycles[NUM_MICRO];  // Median, timer overhead subtracted
+  long samples[NUM_MICRO]; // Timed calls per primitive, over all threads
+  long overhead;           // Median of back-to-back timer reads
 };
 
-struct bench_result {
+struct trim_result {
   float time;
   int num_items;
-  int num_CASSuccess;
-  int num_CASFail;
-  int num_Steal;
+  long rss_start_kb;
+  long rss_peak_kb;
+  long rss_drained_kb;
+  long rss_trimmed_kb;
 };
 
+// Starts counting hardware events for the calling thread. Events the
+// machine or kernel does not support are reported as -1.
+void PerfStart() {
+  static const uint32_t type[NUM_PERF_EVENTS] = {PERF_TYPE_HW_CACHE,
+                                                 PERF_TYPE_HARDWARE};
+  static const uint64_t config[NUM_PERF_EVENTS] = {
+      PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      PERF_COUNT_HW_CACHE_MISSES,
+  };
+  for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+    if (!perfOpened) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type[e];
+      attr.config = config[e];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      perfFd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (perfFd[e] >= 0)
+      ioctl(perfFd[e], PERF_EVENT_IOC_RESET, 0);
+  }
+  perfOpened = true;
+}
+
+long PerfRead(int event) {
+  long count;
+  if (!perfOpened || perfFd[event] < 0 ||
+      read(perfFd[event], &count, sizeof(count)) != sizeof(count))
+    return -1;
+  return count;
+}
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield");
+#endif
+}
+
+// Keeps a moving average of how often this thread's CAS operations fail.
+static inline void RecordCAS(bool success) {
+  casFailRate += ((success ? 0 : 1024) - casFailRate) / 16;
+}
+
+// Waits before retry number attempt (starting at 0) of a contended
+// operation, according to backoffPolicy.
+void Backoff(int attempt) {
+  int cap = BACKOFF_MAX;
+  // Retry counts of the notify rounds grow past the width of an int
+  if (attempt > 16)
+    attempt = 16;
+  switch (backoffPolicy) {
+  case BACKOFF_NONE:
+    return;
+  case BACKOFF_ADAPTIVE:
+    // Scale the window with recent contention, and give up the core once
+    // the window is exhausted under heavy contention.
+    cap = BACKOFF_MIN + (BACKOFF_MAX - BACKOFF_MIN) * casFailRate / 1024;
+    if (casFailRate > 768 && (BACKOFF_MIN << attempt) > cap) {
+      sched_yield();
+      return;
+    }
+    break;
+  }
+  int spins = BACKOFF_MIN << attempt;
+  if (spins > cap)
+    spins = cap;
+  for (int i = 0; i < spins; i++)
+    CpuRelax();
+}
+
+void SetBackoffPolicy(int policy) { backoffPolicy = policy; }
+
+void SetYieldOnEmpty(int yield) { yieldOnEmpty = yield; }
+
+void SetSummary(int enable) { useSummary = enable; }
+
+void SetStealDomains(int threads) { stealDomainSize = threads; }
+
+// CPUs sharing the last level cache of cpu0, from the largest shared_cpu_list
+// in sysfs, or 0 if there is none
+static int CacheSharers() {
+  int sharers = 0;
+  for (int index = 0;; index++) {
+    char path[96], list[1024];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%d/shared_cpu_list",
+             index);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+      return sharers;
+    int cpus = 0;
+    if (fgets(list, sizeof(list), file) != NULL) {
+      // Ranges like 0-7,64-71
+      for (char *range = strtok(list, ",\n"); range != NULL;
+           range = strtok(NULL, ",\n")) {
+        int first, last;
+        int n = sscanf(range, "%d-%d", &first, &last);
+        cpus += n == 2 ? last - first + 1 : n == 1;
+      }
+    }
+    fclose(file);
+    if (cpus > sharers)
+      sharers = cpus;
+  }
+}
+
+// Splits Nr_threads into domains of at most 64 threads, one summary word
+// each. Without a requested size a domain holds the threads of one last
+// level cache, assuming they are spread evenly over the online CPUs.
+static void InitDomains() {
+  int size = stealDomainSize;
+  if (size <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int sharers = CacheSharers();
+    size = online > 0 && sharers > 0
+               ? (int)((Nr_threads * (long)sharers + online - 1) / online)
+               : 64;
+  }
+  domainSize = size < 1 ? 1 : size > 64 ? 64 : size;
+  numDomains = (Nr_threads + domainSize - 1) / domainSize;
+}
+
+// Summary word and bit of thread id
+static inline uint64_t _Atomic *SummaryWord(int id) {
+  return &nonEmpty[id / domainSize].bits;
+}
+
+static inline uint64_t SummaryBit(int id) { return 1ull << (id % domainSize); }
+
+// Flags the list of id and, if need be, its domain. A thief clearing the
+// domain either sees the set thread bit or its clear is seen here, both
+// are sequentially consistent read-modify-writes before the loads.
+static inline void SummaryFlag(int id) {
+  int domain = id / domainSize;
+  uint64_t _Atomic *word = &nonEmptyDomains[domain / 64];
+  uint64_t bit = 1ull << (domain % 64);
+  FAO(SummaryWord(id), SummaryBit(id));
+  if ((LOAD(word) & bit) == 0)
+    FAO(word, bit);
+  atomic_fetch_add(&summaryVersion, 2);
+}
+
+// Owner side, after storing an item: flag the own list unless it already
+// is. Like OwnerTake this only needs a compiler barrier when SummaryClear
+// issues membarrier(2).
+static inline void SummarySet() {
+  if (summaryBarrier)
+    atomic_signal_fence(memory_order_seq_cst);
+  else
+    atomic_thread_fence(memory_order_seq_cst);
+  if ((atomic_load_explicit(ownSummaryWord, memory_order_relaxed) &
+       ownSummaryBit) == 0)
+    SummaryFlag(threadID);
+}
+
+// Orders the store of an item before the loads in Waiting and Signal if
+// SummarySet did not already.
+static inline void AddFence() {
+  if (summaryBarrier)
+    atomic_signal_fence(memory_order_seq_cst);
+  else
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Owner side of the waiter handshake, after storing an item: is anyone
+// blocked in RemoveOrWait?
+static inline bool Waiting() {
+  return atomic_load_explicit(&numWaiters, memory_order_relaxed) != 0;
+}
+
+// Adder side of the readiness fd: the first Add after the bag was found
+// empty makes the fd readable, all others only read readyArmed.
+static inline void Signal() {
+  if (atomic_load_explicit(&readyArmed, memory_order_relaxed) &&
+      atomic_exchange(&readyArmed, false)) {
+    uint64_t one = 1;
+    if (write(readyFd, &one, sizeof(one)) != sizeof(one))
+      perror("eventfd write");
+    atomic_fetch_add_explicit(&readyWrites, 1, memory_order_relaxed);
+  }
+}
+
+int BagEventFd() {
+  if (readyFd < 0) {
+    readyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    readyArmed = true;
+  }
+  return readyFd;
+}
+
+// Consumer side, when TryRemoveAny found the bag empty: clear and rearm
+// the fd, then look again for items whose Add saw the fd still signalled.
+// Without a pending count the Add that disarmed it has not written yet;
+// its write will wake the consumers again.
+static void *Rearm() {
+  uint64_t count;
+  if (readyFd < 0 || LOAD(&readyArmed))
+    return NULL;
+  atomic_fetch_add_explicit(&readyReads, 1, memory_order_relaxed);
+  if (read(readyFd, &count, sizeof(count)) != sizeof(count))
+    return NULL;
+  STORE(&readyArmed, true);
+  if (summaryBarrier)
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+  else
+    atomic_thread_fence(memory_order_seq_cst);
+  rearming = true;
+  void *item = TryRemoveAny();
+  rearming = false;
+  return item;
+}
+
+static void WaiterLock() {
+  while (atomic_flag_test_and_set_explicit(&waiterLock, memory_order_acquire))
+    CpuRelax();
+}
+
+static void WaiterUnlock() {
+  atomic_flag_clear_explicit(&waiterLock, memory_order_release);
+}
+
+// Takes the item just added back from the head of the own list of lane.
+// Unlike TryRemoveAny it never steals and counts no remove for the adder.
+static void *TakeAdded(int lane) {
+  int *head = lane > 0 ? &laneHead[lane] : &threadHead;
+  block_t *block = lane > 0 ? laneBlock[lane] : threadBlock;
+  void *data = block->nodes[*head - 1];
+  if (data == NULL || !CAS(&block->nodes[*head - 1], &data, NULL))
+    return NULL;
+  (*head)--;
+  return data;
+}
+
+// Adder side: claims waiter unless it was claimed or cancelled before
+static bool ClaimWaiter(struct bag_waiter *waiter) {
+  int state = __atomic_load_n(&waiter->state, __ATOMIC_ACQUIRE);
+  while ((state & (WAITER_CLAIMED | WAITER_CANCELLED)) == 0)
+    if (__atomic_compare_exchange_n(&waiter->state, &state,
+                                    state | WAITER_CLAIMED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return true;
+  return false;
+}
+
+// Unlinks waiter from the queue. Needs waiterLock.
+static void UnlinkWaiter(struct bag_waiter *waiter) {
+  struct bag_waiter *prev = NULL, *w = waiterHead;
+  while (w != waiter) {
+    prev = w;
+    w = w->next;
+  }
+  if (prev != NULL)
+    prev->next = waiter->next;
+  else
+    waiterHead = waiter->next;
+  if (waiterTail == waiter)
+    waiterTail = prev;
+  atomic_fetch_sub(&numWaiters, 1);
+}
+
+// Adder side with waiters present: hand the item just added to lane to the
+// oldest waiter that is still queued. If a thief got there first the
+// waiter goes back to waiting for the next Add.
+static void WakeWaiter(int lane) {
+  WaiterLock();
+  struct bag_waiter *waiter = waiterHead;
+  while (waiter != NULL && !ClaimWaiter(waiter))
+    waiter = waiter->next; // Cancelled, its RemoveOrWait unlinks it
+  void *item = waiter != NULL ? TakeAdded(lane) : NULL;
+  if (item != NULL)
+    UnlinkWaiter(waiter);
+  else if (waiter != NULL)
+    __atomic_fetch_and(&waiter->state, ~WAITER_CLAIMED, __ATOMIC_RELEASE);
+  WaiterUnlock();
+  if (item == NULL)
+    return;
+  waiter->item = item;
+  if ((__atomic_fetch_or(&waiter->state, WAITER_HANDED, __ATOMIC_ACQ_REL) &
+       WAITER_BUSY) == 0)
+    waiter->resume(waiter);
+}
+
+void *RemoveOrWait(struct bag_waiter *waiter) {
+  void *item = TryRemoveAny();
+  if (item != NULL)
+    return item;
+  waiter->next = NULL;
+  waiter->state = WAITER_QUEUED | WAITER_BUSY;
+  WaiterLock();
+  if (waiterTail != NULL)
+    waiterTail->next = waiter;
+  else
+    waiterHead = waiter;
+  waiterTail = waiter;
+  atomic_fetch_add(&numWaiters, 1);
+  WaiterUnlock();
+  // After the barrier every Add either sees the waiter in Waiting or has
+  // its item visible to the retry, so no wake-up gets lost.
+  if (summaryBarrier)
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+  else
+    atomic_thread_fence(memory_order_seq_cst);
+  item = TryRemoveAny();
+  if (item != NULL) {
+    int state = WAITER_QUEUED | WAITER_BUSY;
+    if (__atomic_compare_exchange_n(&waiter->state, &state, WAITER_CANCELLED,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      WaiterLock();
+      UnlinkWaiter(waiter);
+      WaiterUnlock();
+      return item;
+    }
+    // An Add claimed the waiter, so it gets an item from there or waits
+    // on. The one of the retry goes back into the bag.
+    Add(item);
+  }
+  if (__atomic_fetch_and(&waiter->state, ~WAITER_BUSY, __ATOMIC_ACQ_REL) &
+      WAITER_HANDED)
+    return waiter->item;
+  // From here on an Add may resume, and free, the waiter at any time
+  return NULL;
+}
+
+// Waits before the next steal round of an empty TryRemoveAny. A preempted
+// owner or adder can only make progress if we give up the core.
+static inline void EmptyWait(int attempt) {
+  if (yieldOnEmpty)
+    sched_yield();
+  else
+    Backoff(attempt);
+}
+
 void NotifyAll(block_t *block) {
-  for (int i = 0; i < (int)(Nr_threads / WORD_SIZE); i++)
+  for (int i = 0; i < (int)((Nr_threads + WORD_SIZE - 1) / WORD_SIZE); i++)
     block->notifyAdd[i] = 0;
 }
 
-block_t *NewBlock() {
-  block_t *block = (block_t *)NewNode(sizeof(block_t));
+block_t *NewBlock(int capacity) {
+  block_t *block = pool[SIZE_CLASS(capacity)];
+  if (block != NULL) {
+    pool[SIZE_CLASS(capacity)] = block->retiredNext;
+    poolBytes -= BLOCK_BYTES(capacity);
+  } else {
+    block = NewNode(BLOCK_BYTES(capacity));
+    numBlockBytes += BLOCK_BYTES(capacity);
+  }
   block->next = NULL;
+  block->prev = NULL;
+  block->capacity = capacity;
+  block->ownerTake = -1;
+  block->stealState = UNSTOLEN;
   NotifyAll(block);
-  for (int i = 0; i < MAX_BLOCK_SIZE; i++)
+  for (int i = 0; i < capacity; i++)
     block->nodes[i] = NULL;
   return block;
 }
 
 void NotifyStart(block_t *block, int Id) {
-  long old;
-  numCASFail--;
-  do {
-    old = block->notifyAdd[Id / WORD_SIZE];
+  unsigned long old;
+  int attempt = 0;
+  old = block->notifyAdd[Id / WORD_SIZE];
+  while (!CAS(&block->notifyAdd[Id / WORD_SIZE], &old,
+              old | (1UL << (Id % WORD_SIZE)))) {
     numCASFail++;
-  } while (!CAS(&block->notifyAdd[Id / WORD_SIZE], &old,
-                old | (1 << (Id % WORD_SIZE))));
+    RecordCAS(false);
+    Backoff(attempt++);
+    old = block->notifyAdd[Id / WORD_SIZE];
+  }
   numCASSuccess++;
+  RecordCAS(true);
 }
 
 bool NotifyCheck(block_t *block, int Id) {
-  return (block->notifyAdd[Id / WORD_SIZE] & (1 << (Id % WORD_SIZE))) == 0;
+  return (block->notifyAdd[Id / WORD_SIZE] & (1UL << (Id % WORD_SIZE))) == 0;
+}
+
+// Owner side of an asymmetric Dekker handshake with MarkStolen: announce the
+// slot and, as long as no thief has marked the block, take it with plain
+// loads and stores. Only a compiler barrier is needed here because the thief
+// pays for the full barrier on all threads with membarrier(2). Returns false
+// if the owner has to fall back to CAS.
+bool OwnerTake(block_t *block, int head, DT **data) {
+  if (atomic_load_explicit(&block->stealState, memory_order_relaxed) !=
+      UNSTOLEN)
+    return false;
+  atomic_store_explicit(&block->ownerTake, head, memory_order_relaxed);
+  atomic_signal_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&block->stealState, memory_order_relaxed) !=
+      UNSTOLEN) {
+    atomic_store_explicit(&block->ownerTake, -1, memory_order_relaxed);
+    return false;
+  }
+  *data = block->nodes[head];
+  block->nodes[head] = NULL;
+  atomic_store_explicit(&block->ownerTake, -1, memory_order_release);
+  return true;
+}
+
+// Spins a thief waits for a membarrier another one started before it
+// issues its own
+#define BARRIER_SPINS 256
+// Blocks a thief marks stolen with one membarrier
+#define MARK_BATCH 16
+
+// Returns once a membarrier has run that started after the caller read
+// barriersStarted into seen, issuing one only if no other thread does.
+static void SharedBarrier(long seen) {
+  long started = seen, ticket = seen + 1;
+  if (!atomic_compare_exchange_strong(&barriersStarted, &started, ticket)) {
+    // Another thread started one since: wait for it to return
+    for (int spins = 0; spins < BARRIER_SPINS; spins++) {
+      if (LOAD(&barriersDone) > seen)
+        return;
+      CpuRelax();
+    }
+    ticket = atomic_fetch_add(&barriersStarted, 1) + 1;
+  }
+  syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+  long done = LOAD(&barriersDone);
+  while (done < ticket && !CAS(&barriersDone, &done, ticket))
+    ;
+}
+
+// Next block a thief walks into from block
+static inline block_t *StealLink(block_t *block) {
+  return stealMode == STEAL_COLD ? LINK_LOAD(&block->prev)
+                                 : LINK_LOAD(&block->next);
+}
+
+// Thief side: the first thief of a block forces the owner onto the CAS path.
+// Once a membarrier that started after the mark returns, the owner either
+// sees the mark or its announced slot is visible in ownerTake, which thieves
+// then skip. The blocks the thief walks into next are marked under the same
+// membarrier, and thieves that mark blocks at the same time, or wait for
+// the same mark, share one.
+void MarkStolen(block_t *block) {
+  int state = LOAD(&block->stealState);
+  if (state == STOLEN)
+    return;
+  if (state == UNSTOLEN &&
+      !atomic_compare_exchange_strong(&block->stealState, &state, MARKING) &&
+      state == STOLEN)
+    return;
+  block_t *marked[MARK_BATCH - 1];
+  int numMarked = 0;
+  for (block_t *next = StealLink(block);
+       next != NULL && numMarked < MARK_BATCH - 1; next = StealLink(next)) {
+    int unstolen = UNSTOLEN;
+    if (atomic_compare_exchange_strong(&next->stealState, &unstolen, MARKING))
+      marked[numMarked++] = next;
+  }
+  // Sequentially consistent after the marks, so the barrier starts after them
+  SharedBarrier(atomic_load(&barriersStarted));
+  STORE(&block->stealState, STOLEN);
+  for (int i = 0; i < numMarked; i++)
+    STORE(&marked[i]->stealState, STOLEN);
+}
+
+void SetOwnerFastPath(int enable) {
+  // The fast path is only safe if the process may issue expedited barriers.
+  ownerFastPath =
+      enable && syscall(SYS_membarrier,
+                        MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+}
+
+// Must be called before a thread dereferences any block it got from a
+// previous operation, so that it never touches a block retired meanwhile.
+void EpochAnnounce() {
+  localEpoch = LOAD(&globalEpoch);
+  STORE(&threadEpoch[threadID].epoch, localEpoch);
+  // The steal cursor may point into a block retired before this epoch
+  stealBlock = NULL;
+  stealHead = MAX_BLOCK_SIZE;
+}
+
+void EpochCheck() {
+  if (atomic_load_explicit(&globalEpoch, memory_order_relaxed) != localEpoch)
+    EpochAnnounce();
+}
+
+void PoolPut(block_t *block) {
+  if (poolBytes + (long)BLOCK_BYTES(block->capacity) > poolHighWater) {
+    DeleteNode(block);
+    return;
+  }
+  block->retiredNext = pool[SIZE_CLASS(block->capacity)];
+  pool[SIZE_CLASS(block->capacity)] = block;
+  poolBytes += BLOCK_BYTES(block->capacity);
+}
+
+// Moves retired blocks that no thread can reference anymore to the pool and
+// advances the global epoch once every thread has caught up with it.
+void Reclaim() {
+  long epoch = LOAD(&globalEpoch);
+  long min = epoch;
+  for (int i = 0; i < Nr_threads; i++) {
+    long e = LOAD(&threadEpoch[i].epoch);
+    if (e < min)
+      min = e;
+  }
+  if (min == epoch)
+    CAS(&globalEpoch, &epoch, epoch + 1);
+
+  block_t **link = &limbo;
+  while (*link != NULL) {
+    block_t *block = *link;
+    if (block->retireEpoch < min) {
+      *link = block->retiredNext;
+      limboCount--;
+      PoolPut(block);
+    } else
+      link = &block->retiredNext;
+  }
+}
+
+// Takes a block that is no longer reachable from globalHeadBlock out of use.
+void Retire(block_t *block) {
+  block->retireEpoch = LOAD(&globalEpoch);
+  block->retiredNext = limbo;
+  limbo = block;
+  if (++limboCount >= RECLAIM_THRESHOLD)
+    Reclaim();
+}
+
+bool BlockEmpty(block_t *block) {
+  for (int i = 0; i < block->capacity; i++)
+    if (block->nodes[i] != NULL)
+      return false;
+  return true;
+}
+
+void SetWorkSharing(int threshold) { shareThreshold = threshold; }
+
+// Idle side: offer the drained own list to producers. The own summary bit
+// is already clear, so a producer's hand-off sets it again. A thread that
+// never had a list starts one with an empty block, so producers only ever
+// link behind a block and never write the head of another list.
+static void Advertise() {
+  uint64_t bit = 1ull << (threadID % 64);
+  if (advertised != NULL)
+    return; // The last offer is still up
+  if (threadBlock == NULL) {
+    threadBlock = NewBlock(threadBlockSize);
+    globalTailBlock[threadID] = threadBlock;
+    globalHeadBlock[threadID] = threadBlock;
+    threadHead = 0;
+    TRACE_EVENT(threadID, TRACE_BLOCK_LINK, threadID, threadBlock,
+                threadBlock->capacity);
+    if (++listLength > maxListLength)
+      maxListLength = listLength;
+  }
+  advertised = threadBlock;
+  STORE(&idleSlot[threadID].block, advertised);
+  if ((LOAD(&idleThreads[threadID / 64]) & bit) == 0)
+    FAO(&idleThreads[threadID / 64], bit);
+}
+
+// Idle side, before touching the own list again: withdraw the offer, or
+// count the block a producer has linked into the list meanwhile. While a
+// producer still holds the slot the offer stays up and the next call looks
+// again, so a preempted producer never holds up the idle thread.
+static void Retract() {
+  block_t *expected = advertised;
+  if (CAS(&idleSlot[threadID].block, &expected, NULL)) {
+    advertised = NULL;
+    return;
+  }
+  if (expected == IDLE_CLAIMED)
+    return;
+  STORE(&idleSlot[threadID].block, NULL);
+  advertised = NULL;
+  if (++listLength > maxListLength)
+    maxListLength = listLength;
+  numReceived++;
+}
+
+// Producer side, after linking a new block: hand the oldest own blocks to
+// idle threads, one block and one pointer store into its list per thread.
+// The block is reachable from the receiver's list before it leaves the own
+// one, and NotifyAll makes thieves that saw it in either list look again.
+// The receiver may unlink its drained block and reset block->prev as soon
+// as the block is linked, so the link is the last write to its list.
+static void ShareBlocks() {
+  for (int w = 0; w <= (Nr_threads - 1) / 64; w++) {
+    uint64_t bits = LOAD(&idleThreads[w]);
+    while (bits != 0 && listLength > shareThreshold) {
+      // The receiver would free it into a chunk this thread still carves
+      if (globalTailBlock[threadID]->fromArena)
+        return;
+      int idle = w * 64 + __builtin_ctzll(bits);
+      uint64_t bit = bits & -bits;
+      bits &= bits - 1;
+      if (idle == threadID)
+        continue;
+      block_t *offer = LOAD(&idleSlot[idle].block);
+      atomic_fetch_and(&idleThreads[w], ~bit);
+      if (offer == NULL || offer == IDLE_CLAIMED || offer == IDLE_HANDED ||
+          !CAS(&idleSlot[idle].block, &offer, IDLE_CLAIMED))
+        continue;
+      block_t *block = globalTailBlock[threadID];
+      block_t *newer = block->prev;
+      LINK_STORE(&block->prev, offer);
+      globalTailBlock[idle] = block;
+      LINK_STORE(&offer->next, block);
+      SummaryFlag(idle);
+      LINK_STORE(&newer->next, NULL);
+      globalTailBlock[threadID] = newer;
+      NotifyAll(block);
+      listLength--;
+      numShared++;
+      STORE(&idleSlot[idle].block, IDLE_HANDED);
+    }
+  }
+}
+
+// Unlinks the blocks behind the owner's current block that thieves have
+// emptied. Only the owner adds to or relinks its list, except for a
+// producer linking a shared block behind an advertised one, so once no
+// offer is up a block found empty stays empty and its successor pointer
+// stays valid for thieves.
+void TrimList() {
+  block_t *prev = threadBlock;
+  // A producer may be linking a block behind the advertised one
+  if (advertised != NULL)
+    return;
+  while (prev != NULL && prev->next != NULL) {
+    block_t *block = prev->next;
+    if (BlockEmpty(block)) {
+      prev->next = block->next;
+      if (block->next != NULL)
+        block->next->prev = prev;
+      else
+        globalTailBlock[threadID] = prev;
+      listLength--;
+      TRACE_EVENT(threadID, TRACE_BLOCK_UNLINK, threadID, block, 0);
+      Retire(block);
+    } else
+      prev = block;
+  }
+}
+
+void Trim() {
+  EpochCheck();
+  if (advertised != NULL)
+    Retract();
+  TrimList();
+  Reclaim();
+  for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+    while (pool[c] != NULL) {
+      block_t *block = pool[c];
+      pool[c] = block->retiredNext;
+      DeleteNode(block);
+    }
+  }
+  poolBytes = 0;
+  malloc_trim(0);
 }
 
+void SetPoolHighWater(long bytes) { poolHighWater = bytes; }
+
+void SetAutoTrim(int enable) { autoTrim = enable; }
+
+void SetCompaction(int blocks) { compactBlocks = blocks; }
+
+void SetStealMode(int mode) { stealMode = mode; }
+
 void InitBag(int num_threads) {
+  // Blocks of a previous bag can be freed, no thread is using it anymore
+  for (int i = 0; i < MAX_NR_THREADS; i++) {
+    while (globalHeadBlock[i] != NULL) {
+      block_t *next = globalHeadBlock[i]->next;
+      DeleteNode(globalHeadBlock[i]);
+      globalHeadBlock[i] = next;
+    }
+  }
+  for (int l = 1; l < NUM_LANES; l++)
+    for (int i = 0; i < MAX_NR_THREADS; i++)
+      while (laneHeadBlock[l][i] != NULL) {
+        block_t *next = laneHeadBlock[l][i]->next;
+        DeleteNode(laneHeadBlock[l][i]);
+        laneHeadBlock[l][i] = next;
+      }
   Nr_threads = num_threads;
-  for (int i = 0; i < Nr_threads; i++)
+  SetOwnerFastPath(ownerFastPath);
+  summaryBarrier = syscall(SYS_membarrier,
+                           MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+  InitDomains();
+  for (int d = 0; d < MAX_NR_THREADS; d++)
+    nonEmpty[d].bits = 0;
+  for (int w = 0; w < (MAX_NR_THREADS + 63) / 64; w++)
+    nonEmptyDomains[w] = 0;
+  for (int l = 0; l < NUM_LANES; l++)
+    for (int w = 0; w < (MAX_NR_THREADS + 63) / 64; w++)
+      laneNonEmpty[l].bits[w] = 0;
+  lanesFlagged = 0;
+  summaryVersion = 0;
+  compactVersion = 0;
+  // Waiters of a previous bag are abandoned
+  waiterHead = waiterTail = NULL;
+  numWaiters = 0;
+  if (readyFd >= 0) {
+    uint64_t count;
+    if (read(readyFd, &count, sizeof(count)) < 0)
+      count = 0;
+  }
+  readyArmed = true;
+  readyWrites = 0;
+  readyReads = 0;
+  for (int i = 0; i < MAX_NR_THREADS; i++)
+    idleSlot[i].block = NULL;
+  for (int w = 0; w < (MAX_NR_THREADS + 63) / 64; w++)
+    idleThreads[w] = 0;
+  for (int i = 0; i < MAX_NR_THREADS; i++)
+    elimSlot[i].item = NULL;
+  for (int i = 0; i < Nr_threads; i++) {
     globalHeadBlock[i] = (block_t *){0};
+    globalTailBlock[i] = (block_t *){0};
+    threadEpoch[i].epoch = globalEpoch;
+  }
 }
 
 void InitThread(int id) {
+  // Retired and pooled blocks of a previous bag are unreachable by now
+  while (limbo != NULL) {
+    block_t *next = limbo->retiredNext;
+    DeleteNode(limbo);
+    limbo = next;
+  }
+  limboCount = 0;
+  for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+    while (pool[c] != NULL) {
+      block_t *next = pool[c]->retiredNext;
+      DeleteNode(pool[c]);
+      pool[c] = next;
+    }
+  }
+  poolBytes = 0;
+  // Chunks still holding blocks are unmapped when their last block goes
+  if (arenaChunk != NULL) {
+    arenaChunk->current = false;
+    if (arenaChunk->live == 0)
+      munmap(arenaChunk, CHUNK_SIZE);
+    arenaChunk = NULL;
+  }
   threadID = id;
   threadBlock = globalHeadBlock[threadID];
   threadHead = MAX_BLOCK_SIZE;
-  stealIndex = 0;
+  threadBlockSize = MIN_BLOCK_SIZE;
+  // Round-robin steals start in the own domain
+  stealIndex = id / domainSize * domainSize;
+  ownSummaryWord = SummaryWord(id);
+  ownSummaryBit = SummaryBit(id);
+  for (int l = 0; l < NUM_LANES; l++) {
+    laneBlock[l] = NULL;
+    laneHead[l] = 0;
+  }
   stealBlock = (block_t *)NULL;
   stealHead = MAX_BLOCK_SIZE;
   numCASSuccess = 0;
   numCASFail = 0;
   numSteal = 0;
+  listLength = 0;
+  maxListLength = 0;
+  numAdd = 0;
+  numRemove = 0;
+  stealHits = stealHitRows[id];
+  stealMisses = stealMissRows[id];
+  memset(stealHits, 0, sizeof(stealHitRows[id]));
+  memset(stealMisses, 0, sizeof(stealMissRows[id]));
+  numBlockBytes = 0;
+  advertised = NULL;
+  numShared = 0;
+  numReceived = 0;
+  numEliminated = 0;
+  numCompacted = 0;
+  blocksSinceCompact = 0;
+  compacting = false;
+  numNull = 0;
+  emptyTicks = 0;
+  rearming = false;
+  EpochAnnounce();
+  PerfStart();
+  TRACE_RESET(id);
+  cpuStartNs = ThreadCpuNs();
+  lastRemoveTicks = ClockTicks();
+  maxRemoveGap = 0;
 }
 
-void Add(void *item) {
+void SetElimination(int slots) {
+  elimSlots = slots < 0 ? 0 : slots > MAX_NR_THREADS ? MAX_NR_THREADS : slots;
+}
+
+// Producer side: hand the item to a consumer waiting in the next slot in
+// turn. The pair linearizes as the Add followed by that TryRemoveAny.
+static inline bool EliminateAdd(void *item) {
+  void *_Atomic *slot = &elimSlot[(threadID + numAdd + numEliminated) %
+                                  elimSlots].item;
+  void *expected = ELIM_WAITING;
+  return atomic_load_explicit(slot, memory_order_relaxed) == ELIM_WAITING &&
+         CAS(slot, &expected, item);
+}
+
+// Consumer side, with an empty own list: wait a little in the own slot.
+// Returns NULL on timeout or if the slot is taken.
+static void *EliminateRemove() {
+  void *_Atomic *slot = &elimSlot[threadID % elimSlots].item;
+  void *item = NULL;
+  if (!CAS(slot, &item, ELIM_WAITING))
+    return NULL;
+  for (int i = 0; i < ELIM_SPINS; i++) {
+    item = LOAD(slot);
+    if (item != ELIM_WAITING) {
+      STORE(slot, NULL);
+      return item;
+    }
+    CpuRelax();
+  }
+  item = ELIM_WAITING;
+  if (CAS(slot, &item, NULL))
+    return NULL;
+  // A producer got in before the timeout
+  STORE(slot, NULL);
+  return item;
+}
+
+// Stores item at the head of the own list, linking a new block if need be.
+// Compact reinserts through here, so moved items are not counted or
+// offered to waiters again.
+static void StoreItem(void *item) {
   int head = threadHead;
   block_t *block = threadBlock;
   for (;;) {
-    if (head == MAX_BLOCK_SIZE) {
+    if (block == NULL || head >= block->capacity) {
+      if (compactBlocks > 0 && blocksSinceCompact >= compactBlocks &&
+          listLength > compactBlocks && !compacting && advertised == NULL) {
+        // Adding resumes in whatever block is the head afterwards
+        Compact();
+        head = threadHead;
+        block = threadBlock;
+        continue;
+      }
+      if (autoTrim)
+        TrimList();
+      // A thread that keeps filling blocks gets geometrically larger ones
+      if (block != NULL && threadBlockSize < MAX_BLOCK_SIZE)
+        threadBlockSize *= 2;
       block_t *oldblock = block;
-      block = NewBlock();
+      block = NewBlock(threadBlockSize);
       block->next = oldblock;
+      if (oldblock != NULL)
+        oldblock->prev = block;
+      else
+        globalTailBlock[threadID] = block;
       globalHeadBlock[threadID] = block;
       threadBlock = block;
       head = 0;
+      TRACE_EVENT(threadID, TRACE_BLOCK_LINK, threadID, block, block->capacity);
+      if (++listLength > maxListLength)
+        maxListLength = listLength;
+      if (shareThreshold > 0 && listLength > shareThreshold &&
+          advertised == NULL)
+        ShareBlocks();
+      blocksSinceCompact++;
     } else if (block->nodes[head] == NULL) {
       NotifyAll(block);
       block->nodes[head] = item;
       threadHead = head + 1;
+      if (useSummary)
+        SummarySet();
+      else
+        AddFence();
+      TRACE_EVENT(threadID, TRACE_ADD, threadID, block, head);
       return;
     } else
       head++;
   }
 }
 
+void Add(void *item) {
+  EpochCheck();
+  if (advertised != NULL)
+    Retract();
+  if (elimSlots > 0 && EliminateAdd(item)) {
+    numEliminated++;
+    return;
+  }
+  StoreItem(item);
+  numAdd++;
+  if (readyFd >= 0)
+    Signal();
+  if (Waiting())
+    WakeWaiter(0);
+}
+
+// Survivors moved per batch, and blocks at most 1/COMPACT_SPARSE full are
+// compacted
+#define COMPACT_BATCH 256
+#define COMPACT_SPARSE 8
+
+// Takes the survivors of sparse blocks behind the head block out with CAS,
+// like a thief would, and stores them again, which packs them into the head
+// end of the list. TrimList then retires the emptied blocks, so thieves
+// still walking them are safe until their next epoch.
+void Compact() {
+  void *moved[COMPACT_BATCH];
+  int n;
+  EpochCheck();
+  if (advertised != NULL)
+    Retract();
+  if (threadBlock == NULL || compacting || advertised != NULL)
+    return;
+  compacting = true;
+  atomic_fetch_add(&compactVersion, 1);
+  do {
+    n = 0;
+    for (block_t *block = threadBlock->next; block != NULL && n < COMPACT_BATCH;
+         block = block->next) {
+      int used = 0;
+      for (int i = 0; i < block->capacity; i++)
+        used += block->nodes[i] != NULL;
+      if (used == 0 || used * COMPACT_SPARSE > block->capacity)
+        continue;
+      for (int i = 0; i < block->capacity && n < COMPACT_BATCH; i++) {
+        void *data = block->nodes[i];
+        if (data != NULL && CAS(&block->nodes[i], &data, NULL))
+          moved[n++] = data;
+      }
+    }
+    for (int i = 0; i < n; i++)
+      StoreItem(moved[i]);
+    numCompacted += n;
+  } while (n == COMPACT_BATCH);
+  atomic_fetch_add(&compactVersion, 1);
+  compacting = false;
+  blocksSinceCompact = 0;
+  TrimList();
+}
+
+// Flags the lane list of id and, if need be, the lane, like SummaryFlag
+static void LaneFlag(int lane, int id) {
+  uint64_t bit = 1ull << lane;
+  FAO(&laneNonEmpty[lane].bits[id / 64], 1ull << (id % 64));
+  if ((LOAD(&lanesFlagged) & bit) == 0)
+    FAO(&lanesFlagged, bit);
+  atomic_fetch_add(&summaryVersion, 2);
+}
+
+void AddPri(void *item, int lane) {
+  if (lane <= 0) {
+    Add(item);
+    return;
+  }
+  if (lane >= NUM_LANES)
+    lane = NUM_LANES - 1;
+  EpochCheck();
+  // Slots from laneHead on were taken by the owner or stolen
+  block_t *block = laneBlock[lane];
+  int head = laneHead[lane];
+  if (block == NULL || head >= block->capacity) {
+    block_t *oldblock = block;
+    block = NewBlock(LANE_BLOCK_SIZE);
+    block->next = oldblock;
+    laneHeadBlock[lane][threadID] = block;
+    laneBlock[lane] = block;
+    head = 0;
+    TRACE_EVENT(threadID, TRACE_BLOCK_LINK, threadID, block, block->capacity);
+  }
+  block->nodes[head] = item;
+  laneHead[lane] = head + 1;
+  numAdd++;
+  AddFence();
+  uint64_t _Atomic *word = &laneNonEmpty[lane].bits[threadID / 64];
+  if ((atomic_load_explicit(word, memory_order_relaxed) &
+       (1ull << (threadID % 64))) == 0)
+    LaneFlag(lane, threadID);
+  TRACE_EVENT(threadID, TRACE_ADD, threadID, block, head);
+  if (readyFd >= 0)
+    Signal();
+  if (Waiting())
+    WakeWaiter(lane);
+}
+
+// First block a thief looks at in the list of stealIndex
+block_t *FirstStealBlock() {
+  if (stealMode == STEAL_COLD)
+    return DeRefLink(&globalTailBlock[stealIndex]);
+  return DeRefLink(&globalHeadBlock[stealIndex]);
+}
+
 block_t *NextStealBlock(block_t *cblock) {
   block_t *block = {cblock};
-  block_t *next;
-  if (block == NULL) {
-    block = globalHeadBlock[stealIndex];
-  } else {
-    next = block->next;
-    block = next;
-  }
+  if (block == NULL)
+    block = FirstStealBlock();
+  else
+    block = StealLink(block);
+  TRACE_EVENT(threadID, TRACE_NEXT_STEAL_BLOCK, stealIndex, block, 0);
   return block;
 }
 
@@ -136,323 +1364,1539 @@ void *TryStealBlock(int round) {
   block_t *block = stealBlock;
   foundAdd = false;
   if (block == NULL) {
-    block = DeRefLink(&globalHeadBlock[stealIndex]);
+    block = FirstStealBlock();
     stealBlock = block;
     stealHead = head = 0;
   }
-  if (head == MAX_BLOCK_SIZE) {
+  if (block != NULL && head >= block->capacity) {
     stealBlock = block = NextStealBlock(block);
     head = 0;
   }
   if (block == NULL) {
+    stealMisses[stealIndex]++;
     stealIndex = (stealIndex + 1) % Nr_threads;
     stealHead = 0;
     stealBlock = NULL;
     return NULL;
   }
+  TRACE_EVENT(threadID, TRACE_STEAL_TRY, stealIndex, block, round);
   if (round == 1)
     NotifyStart(block, threadID);
   else if (round > 1 && NotifyCheck(block, threadID))
     foundAdd = true;
+  int attempt = 0;
   for (;;) {
-    if (head == MAX_BLOCK_SIZE) {
+    if (head >= block->capacity) {
+      stealMisses[stealIndex]++;
       stealHead = head;
       return NULL;
     } else {
       void *data = block->nodes[head];
+      if (data != NULL && ownerFastPath) {
+        MarkStolen(block);
+        if (head == LOAD(&block->ownerTake))
+          data = NULL;
+        else
+          data = block->nodes[head];
+      }
       if (data == NULL)
         head++;
       else if (CAS(&block->nodes[head], &data, NULL)) {
         numCASSuccess++;
+        RecordCAS(true);
         stealHead = head;
+        stealHits[stealIndex]++;
+        TRACE_EVENT(threadID, TRACE_STEAL_HIT, stealIndex, block, head);
         return data;
       } else {
         numCASFail++;
+        RecordCAS(false);
+        Backoff(attempt++);
       }
     }
   }
 }
 
-void *TryRemoveAny() {
-  int head = threadHead - 1;
-  block_t *block = threadBlock;
-  int round = 0;
-  for (;;) {
-    if (block == NULL || (head < 0 && block->next == NULL)) {
+// Thief side of the summary handshake, between clearing a bit and looking
+// at the list once more
+static inline void ClearBarrier() {
+  if (summaryBarrier)
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+  else
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static bool ListEmpty(int id) {
+  for (block_t *block = DeRefLink(&globalHeadBlock[id]); block != NULL;
+       block = LINK_LOAD(&block->next))
+    for (int i = 0; i < block->capacity; i++)
+      if (block->nodes[i] != NULL)
+        return false;
+  return true;
+}
+
+// Thief side: unflag the list of victim, which was just found empty. After
+// the barrier the owner either sees the cleared bit in SummarySet or its
+// item is visible to the rescan, which then restores the bit.
+static void SummaryClear(int victim) {
+  uint64_t _Atomic *word = SummaryWord(victim);
+  uint64_t bit = SummaryBit(victim);
+  atomic_fetch_add(&summaryVersion, 1);
+  atomic_fetch_and(word, ~bit);
+  ClearBarrier();
+  if (!ListEmpty(victim))
+    SummaryFlag(victim);
+  atomic_fetch_add(&summaryVersion, 1);
+}
+
+// Unflags a domain whose thread bits were all found clear. Thread bits set
+// meanwhile are seen by the reload, which then restores the flag.
+static void DomainClear(int domain) {
+  uint64_t _Atomic *word = &nonEmptyDomains[domain / 64];
+  uint64_t bit = 1ull << (domain % 64);
+  atomic_fetch_add(&summaryVersion, 1);
+  atomic_fetch_and(word, ~bit);
+  if (LOAD(&nonEmpty[domain].bits) != 0)
+    FAO(word, bit);
+  atomic_fetch_add(&summaryVersion, 1);
+}
+
+// Steals from the flagged lists of the flagged domains only, the own domain
+// first, and clears the flags of lists and domains found empty. Returns
+// NULL with *empty set if nothing was flagged during a scan of the summary
+// that no Add or clear overlapped, i.e. the bag was empty. Sets *cleared
+// if this scan cleared flags itself.
+static void *SummaryScan(bool *empty, bool *cleared) {
+  long version = LOAD(&summaryVersion);
+  bool flagged = false;
+  int home = threadID / domainSize;
+  *empty = false;
+  *cleared = false;
+  for (int n = 0; n < numDomains; n++) {
+    int domain = (home + n) % numDomains;
+    if ((LOAD(&nonEmptyDomains[domain / 64]) & (1ull << (domain % 64))) == 0)
+      continue;
+    uint64_t bits = LOAD(&nonEmpty[domain].bits);
+    while (bits != 0) {
+      int victim = domain * domainSize + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      flagged = true;
+      if (victim == threadID)
+        continue;
+      // Resume where the last steal from this victim stopped
+      if (victim != stealIndex) {
+        stealIndex = victim;
+        stealBlock = NULL;
+      }
       do {
-        int i = 0;
-        do {
-          numSteal++;
-          void *result = TryStealBlock(round);
-          if (result != NULL)
-            return result;
-          if (foundAdd) {
-            round = 0;
-            i = 0;
-          } else if (stealBlock == NULL && stealHead != MAX_BLOCK_SIZE)
-            i++;
-        } while (i < Nr_threads);
-      } while (++round <= Nr_threads);
-      return NULL;
+        numSteal++;
+        void *result = TryStealBlock(0);
+        if (result != NULL)
+          return result;
+      } while (stealBlock != NULL);
+      SummaryClear(victim);
+      *cleared = true;
     }
-    if (head < 0) {
-      block = threadBlock = block->next;
-      threadHead = MAX_BLOCK_SIZE - 1;
-      head = MAX_BLOCK_SIZE - 1;
-    } else {
-      DT *data = block->nodes[head];
-      if (data != NULL) {
+    if (LOAD(&nonEmpty[domain].bits) == 0) {
+      DomainClear(domain);
+      *cleared = true;
+    }
+  }
+  *empty = !flagged && (version & 1) == 0 && LOAD(&lanesFlagged) == 0 &&
+           LOAD(&summaryVersion) == version;
+  return NULL;
+}
+
+// A scan that cleared stale flags changed the version itself, so scan once
+// more before the caller falls back to the round-robin notify protocol,
+// which is quadratic in the number of threads.
+static void *SummarySteal(bool *empty) {
+  bool cleared;
+  void *result = SummaryScan(empty, &cleared);
+  if (result == NULL && !*empty && cleared)
+    result = SummaryScan(empty, &cleared);
+  return result;
+}
+
+// Owner side: takes the newest item of the own list of lane, unlinking
+// drained blocks on the way. Only the owner adds to it, so once this finds
+// nothing the list is empty and its bit can go.
+static void *LaneTake(int lane) {
+  block_t *block = laneBlock[lane];
+  int head = laneHead[lane] - 1;
+  while (block != NULL) {
+    for (; head >= 0; head--) {
+      void *data = block->nodes[head];
+      while (data != NULL)
         if (CAS(&block->nodes[head], &data, NULL)) {
-          numCASSuccess++;
-          threadHead = head;
+          laneHead[lane] = head;
           return data;
         }
-        numCASFail++;
-      }
-      head--;
     }
+    if (block->next == NULL)
+      break;
+    laneHeadBlock[lane][threadID] = block->next;
+    TRACE_EVENT(threadID, TRACE_BLOCK_UNLINK, threadID, block, 0);
+    Retire(block);
+    block = laneBlock[lane] = block->next;
+    head = block->capacity - 1;
   }
+  laneHead[lane] = 0;
+  atomic_fetch_and(&laneNonEmpty[lane].bits[threadID / 64],
+                   ~(1ull << (threadID % 64)));
+  return NULL;
 }
 
-block_t *DeRefLink(struct block_t **link) { return (block_t *)*link; }
+// Thief side: takes any item of victim's list of lane, or returns NULL if
+// it is empty. Lane lists are short, so thieves keep no cursor.
+static void *LaneSteal(int lane, int victim) {
+  for (block_t *block = DeRefLink(&laneHeadBlock[lane][victim]); block != NULL;
+       block = block->next)
+    for (int i = 0; i < block->capacity; i++) {
+      void *data = block->nodes[i];
+      while (data != NULL)
+        if (CAS(&block->nodes[i], &data, NULL)) {
+          stealHits[victim]++;
+          return data;
+        }
+    }
+  return NULL;
+}
+
+// Unflags victim's list of lane after LaneSteal found it empty, like
+// SummaryClear
+static void LaneClear(int lane, int victim) {
+  atomic_fetch_add(&summaryVersion, 1);
+  atomic_fetch_and(&laneNonEmpty[lane].bits[victim / 64],
+                   ~(1ull << (victim % 64)));
+  ClearBarrier();
+  for (block_t *block = DeRefLink(&laneHeadBlock[lane][victim]); block != NULL;
+       block = block->next)
+    if (!BlockEmpty(block)) {
+      LaneFlag(lane, victim);
+      break;
+    }
+  atomic_fetch_add(&summaryVersion, 1);
+}
+
+// Unflags a lane whose thread bits were all found clear, like DomainClear
+static void LanesClear(int lane) {
+  uint64_t bit = 1ull << lane;
+  atomic_fetch_add(&summaryVersion, 1);
+  atomic_fetch_and(&lanesFlagged, ~bit);
+  for (int w = 0; w <= (Nr_threads - 1) / 64; w++)
+    if (LOAD(&laneNonEmpty[lane].bits[w]) != 0) {
+      FAO(&lanesFlagged, bit);
+      break;
+    }
+  atomic_fetch_add(&summaryVersion, 1);
+}
+
+// Takes an item of the highest flagged lane, from the own list before the
+// lists of others
+static void *LaneRemove() {
+  uint64_t lanes = LOAD(&lanesFlagged);
+  int words = (Nr_threads + 63) / 64;
+  while (lanes != 0) {
+    int lane = 63 - __builtin_clzll(lanes);
+    lanes &= ~(1ull << lane);
+    void *item = LaneTake(lane);
+    if (item != NULL)
+      return item;
+    bool flagged = false;
+    for (int n = 0; n < words; n++) {
+      int w = (threadID / 64 + n) % words;
+      uint64_t bits = LOAD(&laneNonEmpty[lane].bits[w]);
+      while (bits != 0) {
+        int victim = w * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        if (victim == threadID)
+          continue;
+        numSteal++;
+        item = LaneSteal(lane, victim);
+        if (item != NULL)
+          return item;
+        LaneClear(lane, victim);
+      }
+      flagged |= LOAD(&laneNonEmpty[lane].bits[w]) != 0;
+    }
+    if (!flagged)
+      LanesClear(lane);
+  }
+  return NULL;
+}
+
+// Accounts a successful TryRemoveAny, for the fairness report
+static inline void CountRemove() {
+  uint64_t now = ClockTicks();
+  if (now - lastRemoveTicks > maxRemoveGap)
+    maxRemoveGap = now - lastRemoveTicks;
+  lastRemoveTicks = now;
+  numRemove++;
+}
+
+// TryRemoveAny's check of the priority lanes, one load while none is used
+static inline void *TryRemoveLane() {
+  if (atomic_load_explicit(&lanesFlagged, memory_order_relaxed) == 0)
+    return NULL;
+  void *result = LaneRemove();
+  if (result != NULL) {
+    CountRemove();
+    TRACE_EVENT(threadID, TRACE_REMOVE_END, threadID, NULL, 3);
+  }
+  return result;
+}
+
+// Did a Compact overlap the empty path that read version at its start?
+static inline bool CompactRaced(long version) {
+  return (version & 1) != 0 || LOAD(&compactVersion) != version;
+}
+
+// Accounts a NULL return of TryRemoveAny whose empty path began at start.
+// The call Rearm makes accounts an item it finds itself, and leaves a NULL
+// to the outer call.
+static inline void *ReturnEmpty(uint64_t start) {
+  void *item = Rearm();
+  if (item == NULL && !rearming) {
+    numNull++;
+    emptyTicks += ClockTicks() - start;
+  }
+  return item;
+}
+
+void *TryRemoveAny() {
+  EpochCheck();
+  if (advertised != NULL)
+    Retract();
+  TRACE_EVENT(threadID, TRACE_REMOVE_BEGIN, threadID, threadBlock, 0);
+  void *urgent = TryRemoveLane();
+  if (urgent != NULL)
+    return urgent;
+  int head = threadHead - 1;
+  block_t *block = threadBlock;
+  int round = 0, retries = 0;
+  for (;;) {
+    // A producer may link a shared block behind an advertised one
+    if (block == NULL || (head < 0 && LINK_LOAD(&block->next) == NULL)) {
+      uint64_t emptyStart = ClockTicks();
+      long compactions = LOAD(&compactVersion);
+      if (autoTrim && limboCount > 0)
+        Reclaim();
+      // Only the owner adds to its list, so it is really empty now. Blocks
+      // handed over once we advertise set the bit again, and while an offer
+      // is still up one may have been linked after the check above.
+      if (useSummary && advertised == NULL)
+        atomic_fetch_and(ownSummaryWord, ~ownSummaryBit);
+      if (shareThreshold > 0)
+        Advertise();
+      if (elimSlots > 0) {
+        void *result = EliminateRemove();
+        if (result != NULL) {
+          CountRemove();
+          TRACE_EVENT(threadID, TRACE_REMOVE_END, threadID, NULL, 2);
+          return result;
+        }
+      }
+      if (useSummary && round == 0) {
+        bool empty;
+        void *result = SummarySteal(&empty);
+        if (result != NULL) {
+          CountRemove();
+          TRACE_EVENT(threadID, TRACE_REMOVE_END, stealIndex, stealBlock, 1);
+          return result;
+        }
+        if (empty && !CompactRaced(compactions)) {
+          TRACE_EVENT(threadID, TRACE_REMOVE_END, threadID, NULL, -1);
+          return ReturnEmpty(emptyStart);
+        }
+        // An AddPri may have raced with the scan
+        result = TryRemoveLane();
+        if (result != NULL)
+          return result;
+        // Adds or clears raced with the scan: confirm with the notify
+        // protocol below
+        stealBlock = NULL;
+        stealHead = MAX_BLOCK_SIZE;
+      }
+      do {
+        int i = 0;
+        do {
+          numSteal++;
+          void *result = TryStealBlock(round);
+          if (result != NULL) {
+            CountRemove();
+            TRACE_EVENT(threadID, TRACE_REMOVE_END, stealIndex, stealBlock, 1);
+            return result;
+          }
+          if (foundAdd) {
+            // Someone is adding: wait a little for the item to show up
+            EmptyWait(retries++);
+            round = 0;
+            i = 0;
+          } else if (stealBlock == NULL && stealHead != MAX_BLOCK_SIZE)
+            i++;
+        } while (i < Nr_threads);
+        EmptyWait(retries++);
+      } while (++round <= Nr_threads);
+      urgent = TryRemoveLane();
+      if (urgent != NULL)
+        return urgent;
+      if (CompactRaced(compactions)) {
+        // Look again once the moved items are back in a list, starting
+        // with a block that may have been handed to us meanwhile
+        if (advertised != NULL)
+          Retract();
+        block = threadBlock;
+        head = threadHead - 1;
+        round = 0;
+        continue;
+      }
+      TRACE_EVENT(threadID, TRACE_REMOVE_END, threadID, NULL, -1);
+      return ReturnEmpty(emptyStart);
+    }
+    if (head < 0) {
+      // The drained block is always the head of the own list
+      block_t *next = LINK_LOAD(&block->next);
+      globalHeadBlock[threadID] = next;
+      LINK_STORE(&next->prev, NULL);
+      TRACE_EVENT(threadID, TRACE_BLOCK_UNLINK, threadID, block, 0);
+      Retire(block);
+      block = threadBlock = next;
+      threadHead = block->capacity - 1;
+      head = block->capacity - 1;
+      // ... and shrink back as they drain
+      if (threadBlockSize > MIN_BLOCK_SIZE)
+        threadBlockSize /= 2;
+      listLength--;
+    } else {
+      DT *data = block->nodes[head];
+      if (data != NULL) {
+        if (ownerFastPath && OwnerTake(block, head, &data)) {
+          if (data != NULL) {
+            threadHead = head;
+            CountRemove();
+            TRACE_EVENT(threadID, TRACE_REMOVE_END, threadID, block, 0);
+            return data;
+          }
+        } else if (CAS(&block->nodes[head], &data, NULL)) {
+          numCASSuccess++;
+          RecordCAS(true);
+          threadHead = head;
+          CountRemove();
+          TRACE_EVENT(threadID, TRACE_REMOVE_END, threadID, block, 0);
+          return data;
+        } else {
+          numCASFail++;
+          RecordCAS(false);
+        }
+      }
+      head--;
+    }
+  }
+}
+
+block_t *DeRefLink(struct block_t **link) { return (block_t *)*link; }
+
+struct chunk_t *NewChunk() {
+  struct chunk_t *chunk =
+      mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  bool huge = chunk != MAP_FAILED;
+  if (!huge) {
+    // No reserved huge pages: over-map to align the chunk ourselves and
+    // ask for transparent huge pages instead.
+    char *raw = mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+      return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+    if (aligned > raw)
+      munmap(raw, aligned - raw);
+    munmap(aligned + CHUNK_SIZE, raw + CHUNK_SIZE - aligned);
+    madvise(aligned, CHUNK_SIZE, MADV_HUGEPAGE);
+    chunk = (struct chunk_t *)aligned;
+  }
+  chunk->bump = (char *)chunk + 64;
+  chunk->live = 0;
+  chunk->current = true;
+  chunk->huge = huge;
+  return chunk;
+}
+
+block_t *ArenaAlloc(int size) {
+  size = (size + 63) & ~63;
+  if (arenaChunk == NULL ||
+      arenaChunk->bump + size > (char *)arenaChunk + CHUNK_SIZE) {
+    if (arenaChunk != NULL) {
+      arenaChunk->current = false;
+      if (arenaChunk->live == 0)
+        munmap(arenaChunk, CHUNK_SIZE);
+    }
+    if ((arenaChunk = NewChunk()) == NULL)
+      return NULL;
+  }
+  block_t *block = (block_t *)arenaChunk->bump;
+  arenaChunk->bump += size;
+  arenaChunk->live++;
+  return block;
+}
+
+void ArenaFree(block_t *block) {
+  struct chunk_t *chunk =
+      (struct chunk_t *)((uintptr_t)block & ~(CHUNK_SIZE - 1));
+  if (--chunk->live > 0)
+    return;
+  if (!chunk->current) {
+    munmap(chunk, CHUNK_SIZE);
+  } else if (!chunk->huge) {
+    // Keep carving from the start, but give the touched pages back
+    long page = sysconf(_SC_PAGESIZE);
+    char *used = (char *)(((uintptr_t)chunk + 64 + page - 1) & ~(page - 1));
+    if (chunk->bump > used)
+      madvise(used, chunk->bump - used, MADV_DONTNEED);
+    chunk->bump = (char *)chunk + 64;
+  } else
+    chunk->bump = (char *)chunk + 64;
+}
+
+void SetArena(int enable) { useArena = enable; }
+
+block_t * NewNode(int size) {
+  block_t * new = useArena ? ArenaAlloc(size) : NULL;
+  if (new != NULL) {
+    new->fromArena = true;
+    return new;
+  }
+  new = malloc(size);
+  new->fromArena = false;
+  return new;
+};
+
+void DeleteNode(block_t *node) {
+  if (node->fromArena)
+    ArenaFree(node);
+  else
+    free(node);
+}
+
+// Sums up the thread-local counters of all threads into result. Relies on
+// every thread running exactly one iteration, as in the benchmarks.
+void CollectCounters(struct bench_result *result, int num_threads) {
+  struct thread_counters counters[MAX_NR_THREADS];
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    counters[threadID] = (struct thread_counters){
+        .cas_success = numCASSuccess,
+        .cas_fail = numCASFail,
+        .steal = numSteal,
+        .adds = numAdd,
+        .removes = numRemove,
+        .nulls = numNull,
+        .block_bytes = numBlockBytes,
+        .max_list = maxListLength,
+        .cpu_ns = ThreadCpuNs() - cpuStartNs,
+        .dtlb_misses = PerfRead(PERF_DTLB_MISSES),
+        .cache_misses = PerfRead(PERF_CACHE_MISSES),
+        .empty_ticks = emptyTicks,
+        .last_remove_ticks = lastRemoveTicks,
+        .max_remove_gap = maxRemoveGap,
+    };
+  }
+  FillCounters(result, counters, num_threads);
+}
+
+struct bench_result benchmark_add_remove(int num_threads, int num_elems) {
+  // First add num_elems elements per thread and then remove them again
+  struct bench_result result;
+  double tic, toc;
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+
+  tic = omp_get_wtime();
+  {
+#pragma omp parallel for
+    for (int i = 0; i < num_threads; i++) {
+      InitThread(omp_get_thread_num());
+    }
+
+#pragma omp barrier
+
+#pragma omp parallel for
+    for (int i = 0; i < num_threads; i++) {
+      int val = omp_get_thread_num();
+      for (int j = 0; j < (int)(num_elems / (num_threads * 2)); j++) {
+        Add(&val);
+      }
+      for (int j = 0; j < (int)(num_elems / (num_threads * 2)); j++) {
+        int *res = (int *)(TryRemoveAny());
+      }
+    }
+  }
+  toc = omp_get_wtime();
+
+  CollectCounters(&result, num_threads);
+  result.time = toc - tic;
+  result.num_items = num_threads * (int)(num_elems / num_threads);
+  return result;
+}
+
+// Copies who stole from whom in the last run: hits and misses are
+// num_threads x num_threads matrices indexed [thief * num_threads + victim],
+// added and removed hold the items each thread added and removed.
+void StealMatrix(int num_threads, long *hits, long *misses, long *added,
+                 long *removed) {
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    memcpy(&hits[threadID * num_threads], stealHits, num_threads * sizeof(long));
+    memcpy(&misses[threadID * num_threads], stealMisses,
+           num_threads * sizeof(long));
+    added[threadID] = numAdd;
+    removed[threadID] = numRemove;
+  }
+}
+
+struct bench_result benchmark_random(int num_threads, int num_elems) {
+  struct bench_result result;
+  double tic, toc;
+  srand(1);
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+
+  tic = omp_get_wtime();
+  {
+#pragma omp parallel for
+    for (int i = 0; i < num_threads; i++) {
+      InitThread(omp_get_thread_num());
+    }
+
+#pragma omp barrier
+
+#pragma omp parallel for
+    for (int i = 0; i < num_threads; i++) {
+      int val = omp_get_thread_num();
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        if ((float)rand() / (float)(RAND_MAX) < 0.5) {
+          Add(&val);
+        } else {
+          int *res = (int *)(TryRemoveAny());
+        }
+      }
+    }
+  }
+  toc = omp_get_wtime();
+
+  CollectCounters(&result, num_threads);
+  result.time = toc - tic;
+  result.num_items = num_threads * (int)(num_elems / num_threads);
+  return result;
+}
+
+struct bench_result benchmark_half_half(int num_threads, int num_elems) {
+  struct bench_result result;
+  double tic, toc;
+  srand(1);
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+
+  tic = omp_get_wtime();
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    InitThread(omp_get_thread_num());
+  }
+
+#pragma omp barrier
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    if (omp_get_thread_num() > (int)(num_threads / 2)) {
+      int val = omp_get_thread_num();
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        Add(&val);
+      }
+
+    } else {
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        int *res = (int *)(TryRemoveAny());
+      }
+    }
+  }
+  toc = omp_get_wtime();
+
+  CollectCounters(&result, num_threads);
+  result.time = toc - tic;
+  result.num_items = num_threads * (int)(num_elems / num_threads);
+  return result;
+}
+
+struct bench_result benchmark_one_producer(int num_threads, int num_elems) {
+  struct bench_result result;
+  double tic, toc;
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+
+  tic = omp_get_wtime();
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    InitThread(omp_get_thread_num());
+  }
+
+#pragma omp barrier
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    if (omp_get_thread_num() == 0) {
+      int val = omp_get_thread_num();
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        Add(&val);
+      }
+
+    } else {
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        int *res = (int *)(TryRemoveAny());
+      }
+    }
+  }
+
+  toc = omp_get_wtime();
+
+  CollectCounters(&result, num_threads);
+  result.time = toc - tic;
+  result.num_items = num_threads * (int)(num_elems / num_threads);
+  return result;
+}
+
+struct bench_result benchmark_one_consumer(int num_threads, int num_elems) {
+  struct bench_result result;
+  double tic, toc;
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+
+  tic = omp_get_wtime();
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    InitThread(omp_get_thread_num());
+  }
+
+#pragma omp barrier
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    if (omp_get_thread_num() != 0) {
+      int val = omp_get_thread_num();
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        Add(&val);
+      }
+
+    } else {
+      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+        int *res = (int *)(TryRemoveAny());
+      }
+    }
+  }
+
+  toc = omp_get_wtime();
+
+  CollectCounters(&result, num_threads);
+  result.time = toc - tic;
+  result.num_items = num_threads * (int)(num_elems / num_threads);
+  return result;
+}
+
+long ResidentKB() {
+  long size = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL)
+    return -1;
+  if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+    resident = -1;
+  fclose(statm);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+struct trim_result benchmark_spike_drain(int num_threads, int num_elems) {
+  // All threads add their share of num_elems at once, then drain the bag
+  // and trim. Reports the resident set size after each phase.
+  struct trim_result result;
+  double tic, toc;
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+  malloc_trim(0);
+  result.rss_start_kb = ResidentKB();
+
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads)
+  {
+    int val = omp_get_thread_num();
+    InitThread(omp_get_thread_num());
+#pragma omp barrier
+    for (int j = 0; j < num_elems / num_threads; j++)
+      Add(&val);
+#pragma omp barrier
+#pragma omp single
+    result.rss_peak_kb = ResidentKB();
+    while (TryRemoveAny() != NULL)
+      ;
+#pragma omp barrier
+#pragma omp single
+    result.rss_drained_kb = ResidentKB();
+    // Every thread has to pass through the bag twice before the blocks
+    // retired during the drain are past their grace period.
+    for (int r = 0; r < 3; r++) {
+      Trim();
+#pragma omp barrier
+    }
+  }
+  toc = omp_get_wtime();
+
+  result.rss_trimmed_kb = ResidentKB();
+  result.time = toc - tic;
+  result.num_items = num_threads * (num_elems / num_threads);
+  return result;
+}
+
+struct bench_result benchmark_deep_steal(int num_threads, int num_elems) {
+  // The first half of the threads fill deep lists, then the other half
+  // drain them purely by stealing, walking every block of every list.
+  struct bench_result result;
+  int producers = num_threads > 1 ? num_threads / 2 : 1;
+  double tic, toc;
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
+
+#pragma omp parallel for
+  for (int i = 0; i < num_threads; i++) {
+    InitThread(omp_get_thread_num());
+  }
+
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads)
+  {
+    int val = omp_get_thread_num();
+    if (omp_get_thread_num() < producers)
+      for (int j = 0; j < num_elems / producers; j++)
+        Add(&val);
+#pragma omp barrier
+    if (omp_get_thread_num() >= producers || num_threads == 1)
+      while (TryRemoveAny() != NULL)
+        ;
+  }
+  toc = omp_get_wtime();
 
-block_t * NewNode(int size) {
-  block_t * new = malloc(size);
-  return new;
-};
+  CollectCounters(&result, num_threads);
+  result.time = toc - tic;
+  result.num_items = producers * (num_elems / producers);
+  return result;
+}
 
-struct bench_result benchmark_add_remove(int num_threads, int num_elems) {
-  // First add num_elems elements per thread and then remove them again
+struct bench_result benchmark_thief_contention(int num_threads, int num_elems) {
+  // Thread 0 adds num_elems items while all other threads keep stealing
+  // from it. Only the producer is timed, so result.time shows how much the
+  // thieves slow it down.
   struct bench_result result;
-  double tic, toc;
+  bool _Atomic done = false;
+  double elapsed = 0;
 
   omp_set_num_threads(num_threads);
   InitBag(num_threads);
 
-  tic = omp_get_wtime();
-  {
 #pragma omp parallel for
-    for (int i = 0; i < num_threads; i++) {
-      InitThread(omp_get_thread_num());
-    }
+  for (int i = 0; i < num_threads; i++) {
+    InitThread(omp_get_thread_num());
+  }
 
+#pragma omp parallel num_threads(num_threads)
+  {
+    int val = omp_get_thread_num();
 #pragma omp barrier
-
-#pragma omp parallel for
-    for (int i = 0; i < num_threads; i++) {
-      int val = omp_get_thread_num();
-      for (int j = 0; j < (int)(num_elems / (num_threads * 2)); j++) {
+    if (omp_get_thread_num() == 0) {
+      double tic = omp_get_wtime();
+      for (int j = 0; j < num_elems; j++)
         Add(&val);
-      }
-      for (int j = 0; j < (int)(num_elems / (num_threads * 2)); j++) {
-        int *res = (int *)(TryRemoveAny());
-      }
+      elapsed = omp_get_wtime() - tic;
+      STORE(&done, true);
+    } else {
+      while (TryRemoveAny() != NULL || !LOAD(&done))
+        ;
     }
   }
-  toc = omp_get_wtime();
 
-  int cassuc, casfail, steal = 0;
-#pragma omp parallel for reduction(+ : cassuc, casfail, steal)
-  for (int i = 0; i < num_threads; i++) {
-    cassuc += numCASSuccess;
-    casfail += numCASFail;
-    steal += numSteal;
-  }
-  result.num_CASSuccess = cassuc;
-  result.num_CASFail = casfail;
-  result.num_Steal = steal;
-  result.time = toc - tic;
-  result.num_items = num_threads * (int)(num_elems / num_threads);
+  CollectCounters(&result, num_threads);
+  result.time = elapsed;
+  result.num_items = num_elems;
   return result;
 }
 
-struct bench_result benchmark_random(int num_threads, int num_elems) {
+struct bench_result benchmark_empty_poll(int num_threads, int num_elems) {
+  // All threads keep polling an empty bag, the cost of a NULL return
   struct bench_result result;
   double tic, toc;
-  srand(1);
 
   omp_set_num_threads(num_threads);
   InitBag(num_threads);
 
-  tic = omp_get_wtime();
-  {
 #pragma omp parallel for
-    for (int i = 0; i < num_threads; i++) {
-      InitThread(omp_get_thread_num());
-    }
-
-#pragma omp barrier
+  for (int i = 0; i < num_threads; i++) {
+    InitThread(omp_get_thread_num());
+  }
 
+  tic = omp_get_wtime();
 #pragma omp parallel for
-    for (int i = 0; i < num_threads; i++) {
-      int val = omp_get_thread_num();
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
-        if ((float)rand() / (float)(RAND_MAX) < 0.5) {
-          Add(&val);
-        } else {
-          int *res = (int *)(TryRemoveAny());
-        }
-      }
-    }
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < (int)(num_elems / num_threads); j++)
+      TryRemoveAny();
   }
   toc = omp_get_wtime();
 
-  int cassuc, casfail, steal = 0;
-#pragma omp parallel for reduction(+ : cassuc, casfail, steal)
-  for (int i = 0; i < num_threads; i++) {
-    cassuc += numCASSuccess;
-    casfail += numCASFail;
-    steal += numSteal;
-  }
-  result.num_CASSuccess = cassuc;
-  result.num_CASFail = casfail;
-  result.num_Steal = steal;
+  CollectCounters(&result, num_threads);
   result.time = toc - tic;
   result.num_items = num_threads * (int)(num_elems / num_threads);
   return result;
 }
 
-struct bench_result benchmark_half_half(int num_threads, int num_elems) {
-  struct bench_result result;
+struct eventfd_result benchmark_eventfd(int num_threads, int num_elems,
+                                        int burst) {
+  // Thread 0 sleeps in epoll_wait on the readiness fd and drains the bag
+  // whenever it wakes; the other threads add bursts of burst items with
+  // pauses in between that keep the average rate independent of burst.
+  // A missed signal only delays the drain to the next timeout, and the
+  // consumer stops after the first drain that started once all producers
+  // were done, so lost items are counted instead of hanging the run.
+  struct eventfd_result result = {0};
+  int _Atomic producersDone = 0;
+  if (num_threads < 2)
+    num_threads = 2;
+  int per_producer = num_elems / (num_threads - 1);
+  long total = (long)per_producer * (num_threads - 1);
+  int val = 1;
   double tic, toc;
-  srand(1);
 
+  omp_set_dynamic(0);
   omp_set_num_threads(num_threads);
+  int fd = BagEventFd();
   InitBag(num_threads);
-
-  tic = omp_get_wtime();
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN};
+  epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
 
 #pragma omp parallel for
   for (int i = 0; i < num_threads; i++) {
     InitThread(omp_get_thread_num());
   }
 
-#pragma omp barrier
-
-#pragma omp parallel for
-  for (int i = 0; i < num_threads; i++) {
-    if (omp_get_thread_num() > (int)(num_threads / 2)) {
-      int val = omp_get_thread_num();
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
-        Add(&val);
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads)
+  {
+    if (omp_get_thread_num() == 0) {
+      long removed = 0, wakeups = 0, late = 0;
+      bool done = false;
+      while (removed < total && !done) {
+        done = atomic_load(&producersDone) == num_threads - 1;
+        struct epoll_event ready;
+        int n = epoll_wait(epoll, &ready, 1, 10);
+        wakeups++;
+        long before = removed;
+        while (TryRemoveAny() != NULL)
+          removed++;
+        // A timeout that still finds items means a missed signal
+        if (n == 0 && removed > before)
+          late++;
       }
-
+      result.num_wakeups = wakeups;
+      result.num_late_wakeups = late;
+      result.num_lost = total - removed;
     } else {
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
-        int *res = (int *)(TryRemoveAny());
+      for (int j = 0; j < per_producer; j++) {
+        Add(&val);
+        if ((j + 1) % burst == 0)
+          for (int k = 0; k < burst * 100; k++)
+            CpuRelax();
       }
+      atomic_fetch_add(&producersDone, 1);
     }
   }
   toc = omp_get_wtime();
+  close(epoll);
 
-  int cassuc, casfail, steal = 0;
-#pragma omp parallel for reduction(+ : cassuc, casfail, steal)
-  for (int i = 0; i < num_threads; i++) {
-    cassuc += numCASSuccess;
-    casfail += numCASFail;
-    steal += numSteal;
-  }
-  result.num_CASSuccess = cassuc;
-  result.num_CASFail = casfail;
-  result.num_Steal = steal;
   result.time = toc - tic;
-  result.num_items = num_threads * (int)(num_elems / num_threads);
+  result.num_items = total;
+  result.num_writes = readyWrites;
+  result.num_reads = readyReads;
   return result;
 }
 
-struct bench_result benchmark_one_producer(int num_threads, int num_elems) {
-  struct bench_result result;
+// Runs a phased workload (see workload.h) against this bag
+void benchmark_workload(int num_threads, const struct workload_phase *phases,
+                        int num_phases, struct workload_result *result) {
+  const struct bag_ops bag = {InitBag, InitThread, Add, TryRemoveAny};
+  RunWorkload(&bag, num_threads, phases, num_phases, result);
+}
+
+// Count false empties in benchmark_validate, set by the validate modes that
+// move items around behind the thieves' backs
+static bool validateEmpty;
+
+// Checks exactly-once delivery with RunValidate (see bench.h), sending some
+// of the items to priority lanes
+struct validate_result benchmark_validate(int num_threads, long num_ops) {
+  const struct bag_ops bag = {InitBag, InitThread, Add, TryRemoveAny};
+  return RunValidate(&bag, AddPri, NUM_LANES, num_threads, num_ops,
+                     validateEmpty);
+}
+
+static long NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int CompareLong(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+struct oversub_result benchmark_oversubscribed(int num_threads, int num_elems) {
+  // Like benchmark_random, but meant to run with more threads than cores.
+  // Every TryRemoveAny is timed, and a NULL return counts as false-empty if
+  // more items had been added before the call than were removed after it.
+  // Removals still in flight make this an upper bound.
+  struct oversub_result result = {0};
+  struct {
+    long _Atomic added, removed;
+    char pad[64 - 2 * sizeof(long)];
+  } count[MAX_NR_THREADS];
+  int ops_per_thread = num_elems / num_threads;
+  long *latency = malloc(sizeof(long) * ops_per_thread * num_threads);
+  long num_null = 0, false_empty = 0;
+  long taken[MAX_NR_THREADS] = {0};
   double tic, toc;
 
+  if (latency == NULL) {
+    fprintf(stderr, "oversubscribed: cannot allocate latency samples\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(count, 0, sizeof(count));
+  // Oversubscription only works if OpenMP hands out all requested threads
+  omp_set_dynamic(0);
   omp_set_num_threads(num_threads);
   InitBag(num_threads);
 
-  tic = omp_get_wtime();
-
 #pragma omp parallel for
   for (int i = 0; i < num_threads; i++) {
     InitThread(omp_get_thread_num());
   }
 
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads) reduction(+ : num_null, false_empty)
+  {
+    int id = omp_get_thread_num();
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (id + 1);
+    long *samples = latency + (long)id * ops_per_thread;
+    int val = id;
 #pragma omp barrier
+    for (int j = 0; j < ops_per_thread; j++) {
+      if (XorShift(&rng) & 1) {
+        Add(&val);
+        STORE(&count[id].added, LOAD(&count[id].added) + 1);
+        continue;
+      }
+      long added = 0, removed = 0;
+      for (int i = 0; i < num_threads; i++)
+        added += LOAD(&count[i].added);
+      long start = NowNs();
+      void *item = TryRemoveAny();
+      samples[taken[id]++] = NowNs() - start;
+      if (item != NULL) {
+        STORE(&count[id].removed, LOAD(&count[id].removed) + 1);
+        continue;
+      }
+      num_null++;
+      for (int i = 0; i < num_threads; i++)
+        removed += LOAD(&count[i].removed);
+      false_empty += added > removed;
+    }
+  }
+  toc = omp_get_wtime();
 
-#pragma omp parallel for
+  // Pack the samples of all threads to the front and sort them
+  long n = 0;
   for (int i = 0; i < num_threads; i++) {
-    if (omp_get_thread_num() == 0) {
-      int val = omp_get_thread_num();
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
+    memmove(latency + n, latency + (long)i * ops_per_thread,
+            taken[i] * sizeof(long));
+    n += taken[i];
+  }
+  qsort(latency, n, sizeof(long), CompareLong);
+
+  result.time = toc - tic;
+  result.num_items = num_threads * ops_per_thread;
+  result.num_null = num_null;
+  result.num_false_empty = false_empty;
+  if (n > 0) {
+    result.p50_ns = latency[n / 2];
+    result.p99_ns = latency[n * 99 / 100];
+    result.p999_ns = latency[n * 999 / 1000];
+  }
+  free(latency);
+  return result;
+}
+
+// Serialized cycle counter reads around a timed region: nothing before
+// TscBegin or after TscEnd can execute inside it.
+static inline uint64_t TscBegin() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_lfence();
+  return __builtin_ia32_rdtsc();
+#else
+  __asm__ volatile("isb" ::: "memory");
+  return ClockTicks();
+#endif
+}
+
+static inline uint64_t TscEnd() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int aux;
+  uint64_t tsc = __builtin_ia32_rdtscp(&aux);
+  __builtin_ia32_lfence();
+  return tsc;
+#else
+  __asm__ volatile("isb" ::: "memory");
+  return ClockTicks();
+#endif
+}
+
+// Per-thread sample buffers of benchmark_micro
+struct micro_samples {
+  long *cycles[NUM_MICRO];
+  long count[NUM_MICRO];
+};
+
+static inline void MicroRecord(struct micro_samples *samples, int primitive,
+                               long num_samples, uint64_t tic, uint64_t toc) {
+  if (samples->count[primitive] < num_samples)
+    samples->cycles[primitive][samples->count[primitive]++] = toc - tic;
+}
+
+// Median over the samples of all threads, minus the timer overhead
+static long MicroMedian(struct micro_samples *samples, int num_threads,
+                        int primitive, long overhead, long *count) {
+  long n = 0;
+  for (int t = 0; t < num_threads; t++)
+    n += samples[t].count[primitive];
+  *count = n;
+  if (n == 0)
+    return -1;
+  long *all = malloc(sizeof(long) * n);
+  n = 0;
+  for (int t = 0; t < num_threads; t++)
+    for (long i = 0; i < samples[t].count[primitive]; i++)
+      all[n++] = samples[t].cycles[primitive][i];
+  qsort(all, n, sizeof(long), CompareLong);
+  long median = all[n / 2] - overhead;
+  free(all);
+  return median > 0 ? median : 0;
+}
+
+struct micro_result benchmark_micro(int num_threads, int num_samples) {
+  // Times single calls with serialized rdtsc while num_threads threads run
+  // the same primitive side by side. A call is attributed to a primitive
+  // by what it changed: the own head block, the steal cursor, numSteal.
+  // Local primitives run on every thread's own list; steals run with
+  // num_threads thieves against as many victims that filled their lists
+  // before and stay idle.
+  struct micro_result result = {0};
+  struct micro_samples samples[MAX_NR_THREADS];
+  long overhead[MAX_NR_THREADS];
+  int val = 1;
+
+  if (num_threads > MAX_NR_THREADS / 2)
+    num_threads = MAX_NR_THREADS / 2;
+  memset(samples, 0, sizeof(samples));
+  for (int t = 0; t < num_threads; t++)
+    for (int m = 0; m < NUM_MICRO; m++) {
+      samples[t].cycles[m] = malloc(sizeof(long) * num_samples);
+      if (samples[t].cycles[m] == NULL) {
+        fprintf(stderr, "micro: cannot allocate %d samples\n", num_samples);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+  omp_set_dynamic(0);
+  InitBag(num_threads);
+#pragma omp parallel num_threads(num_threads)
+  {
+    int id = omp_get_thread_num();
+    struct micro_samples *mine = &samples[id];
+    uint64_t tic, toc;
+    InitThread(id);
+
+    long *timer = malloc(sizeof(long) * num_samples);
+    for (int s = 0; s < num_samples; s++) {
+      tic = TscBegin();
+      toc = TscEnd();
+      timer[s] = toc - tic;
+    }
+    qsort(timer, num_samples, sizeof(long), CompareLong);
+    overhead[id] = timer[num_samples / 2];
+    free(timer);
+
+#pragma omp barrier
+    for (int s = 0; s < num_samples; s++) {
+      // Fill the head block, then link a new one
+      while (threadBlock != NULL && threadHead < threadBlock->capacity) {
+        tic = TscBegin();
         Add(&val);
+        toc = TscEnd();
+        MicroRecord(mine, MICRO_ADD, num_samples, tic, toc);
+      }
+      tic = TscBegin();
+      Add(&val);
+      toc = TscEnd();
+      MicroRecord(mine, MICRO_ADD_NEW_BLOCK, num_samples, tic, toc);
+      // Empty the new head block; the next remove retires it
+      void *item = TryRemoveAny();
+      block_t *before = threadBlock;
+      int steals = numSteal;
+      tic = TscBegin();
+      item = TryRemoveAny();
+      toc = TscEnd();
+      if (item != NULL && numSteal == steals && threadBlock != before)
+        MicroRecord(mine, MICRO_RETIRE, num_samples, tic, toc);
+      // Keep the list short
+      if (s % 8 == 7) {
+        do {
+          before = threadBlock;
+          steals = numSteal;
+          tic = TscBegin();
+          item = TryRemoveAny();
+          toc = TscEnd();
+          if (item != NULL && numSteal == steals)
+            MicroRecord(mine, threadBlock == before ? MICRO_REMOVE : MICRO_RETIRE,
+                        num_samples, tic, toc);
+        } while (item != NULL);
       }
+    }
+    while (TryRemoveAny() != NULL)
+      ;
 
-    } else {
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
-        int *res = (int *)(TryRemoveAny());
+    // No Add runs after this barrier
+#pragma omp barrier
+    for (int s = 0; s < num_samples; s++) {
+      tic = TscBegin();
+      void *item = TryRemoveAny();
+      toc = TscEnd();
+      if (item == NULL)
+        MicroRecord(mine, MICRO_EMPTY, num_samples, tic, toc);
+    }
+  }
+
+  InitBag(2 * num_threads);
+#pragma omp parallel num_threads(2 * num_threads)
+  {
+    int id = omp_get_thread_num();
+    InitThread(id);
+    if (id >= num_threads)
+      for (int s = 0; s < num_samples; s++)
+        Add(&val);
+#pragma omp barrier
+    if (id < num_threads) {
+      struct micro_samples *mine = &samples[id];
+      // Start at a different victim each
+      stealIndex = num_threads + id;
+      for (int s = 0; s < num_samples; s++) {
+        block_t *before = stealBlock;
+        int victim = stealIndex;
+        uint64_t tic = TscBegin();
+        void *item = TryRemoveAny();
+        uint64_t toc = TscEnd();
+        if (item == NULL)
+          break;
+        bool warm = before != NULL && stealBlock == before && stealIndex == victim;
+        MicroRecord(mine, warm ? MICRO_STEAL_WARM : MICRO_STEAL_COLD,
+                    num_samples, tic, toc);
       }
     }
   }
 
-  toc = omp_get_wtime();
+  long timer[MAX_NR_THREADS];
+  memcpy(timer, overhead, sizeof(long) * num_threads);
+  qsort(timer, num_threads, sizeof(long), CompareLong);
+  result.overhead = timer[num_threads / 2];
+  for (int m = 0; m < NUM_MICRO; m++)
+    result.cycles[m] = MicroMedian(samples, num_threads, m, result.overhead,
+                                   &result.samples[m]);
+  for (int t = 0; t < num_threads; t++)
+    for (int m = 0; m < NUM_MICRO; m++)
+      free(samples[t].cycles[m]);
+  return result;
+}
+
+struct sharing_result benchmark_sharing(int num_threads, int num_elems,
+                                        int skewed) {
+  // Thread 0 adds all items (skewed == 0), or thread i adds a share
+  // proportional to 1 / (i + 1) of them (skewed == 1); everybody else
+  // removes until all items are gone. Items are the times of their Add,
+  // so the removing thread measures how long each one waited in the bag.
+  struct sharing_result result = {0};
+  long *stamp = malloc(sizeof(long) * num_elems);
+  long *latency = malloc(sizeof(long) * num_elems);
+  int share[MAX_NR_THREADS];
+  long _Atomic removed = 0;
+  long steals = 0, hits = 0, shared = 0;
+  double tic, toc, sum = 0;
+
+  if (stamp == NULL || latency == NULL) {
+    fprintf(stderr, "sharing: cannot allocate %d samples\n", num_elems);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < num_threads; i++)
+    sum += skewed ? 1.0 / (i + 1) : i == 0;
+  int assigned = 0;
+  for (int i = 0; i < num_threads; i++) {
+    share[i] = num_elems * (skewed ? 1.0 / (i + 1) : i == 0) / sum;
+    assigned += share[i];
+  }
+  share[0] += num_elems - assigned;
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
 
-  int cassuc, casfail, steal = 0;
-#pragma omp parallel for reduction(+ : cassuc, casfail, steal)
+#pragma omp parallel for
   for (int i = 0; i < num_threads; i++) {
-    cassuc += numCASSuccess;
-    casfail += numCASFail;
-    steal += numSteal;
+    InitThread(omp_get_thread_num());
+  }
+
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads) reduction(+ : steals, hits, shared)
+  {
+    int id = omp_get_thread_num();
+    int first = 0;
+    for (int i = 0; i < id; i++)
+      first += share[i];
+    for (int j = first; LOAD(&removed) < num_elems;) {
+      if (j < first + share[id]) {
+        stamp[j] = NowNs();
+        Add(&stamp[j]);
+        j++;
+      }
+      // A lone producer only produces
+      if (!skewed && id == 0 && num_threads > 1)
+        continue;
+      long *item = TryRemoveAny();
+      if (item != NULL) {
+        latency[atomic_fetch_add(&removed, 1)] = NowNs() - *item;
+      }
+    }
+    steals = numSteal;
+    for (int v = 0; v < num_threads; v++)
+      hits += stealHits[v];
+    shared = numShared;
   }
-  result.num_CASSuccess = cassuc;
-  result.num_CASFail = casfail;
-  result.num_Steal = steal;
+  toc = omp_get_wtime();
+
+  qsort(latency, num_elems, sizeof(long), CompareLong);
   result.time = toc - tic;
-  result.num_items = num_threads * (int)(num_elems / num_threads);
+  result.num_items = num_elems;
+  result.num_steal = steals;
+  result.num_steal_hits = hits;
+  result.num_shared = shared;
+  result.p50_ns = latency[num_elems / 2];
+  result.p99_ns = latency[(long)num_elems * 99 / 100];
+  result.p999_ns = latency[(long)num_elems * 999 / 1000];
+  free(stamp);
+  free(latency);
   return result;
 }
 
-struct bench_result benchmark_one_consumer(int num_threads, int num_elems) {
-  struct bench_result result;
+struct elim_result benchmark_elimination(int num_threads, int num_elems) {
+  // Balanced mix: every thread adds or removes with equal probability, so
+  // lists keep running dry and adds meet removes all the time.
+  struct elim_result result = {0};
+  long eliminated = 0, steals = 0, nulls = 0;
+  int val = 1;
   double tic, toc;
 
   omp_set_num_threads(num_threads);
   InitBag(num_threads);
 
-  tic = omp_get_wtime();
-
 #pragma omp parallel for
   for (int i = 0; i < num_threads; i++) {
     InitThread(omp_get_thread_num());
   }
 
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads) reduction(+ : eliminated, steals, nulls)
+  {
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (omp_get_thread_num() + 1);
+    for (int j = 0; j < num_elems / num_threads; j++) {
+      if (XorShift(&rng) & 1)
+        Add(&val);
+      else if (TryRemoveAny() == NULL)
+        nulls++;
+    }
+    eliminated = numEliminated;
+    steals = numSteal;
+  }
+  toc = omp_get_wtime();
+
+  result.time = toc - tic;
+  result.num_items = num_threads * (num_elems / num_threads);
+  result.num_eliminated = eliminated;
+  result.num_steal = steals;
+  result.num_null = nulls;
+  return result;
+}
+
+struct compact_result benchmark_compaction(int num_threads, int num_elems,
+                                          int compact) {
+  // num_threads owners fill their lists, then keep only every 16th item
+  // behind their head block, the gaps that removes and steals leave in a
+  // mixed workload. With compact set they compact their lists. Then as
+  // many thieves, whose own lists are empty, drain the survivors while
+  // the owners stay idle.
+  struct compact_result result = {0};
+  long before = 0, after = 0, survivors = 0, slowest = 0;
+  int val = 1;
+  double tic = 0, toc = 0;
+
+  if (num_threads > MAX_NR_THREADS / 2)
+    num_threads = MAX_NR_THREADS / 2;
+  omp_set_dynamic(0);
+  InitBag(2 * num_threads);
+
+#pragma omp parallel num_threads(2 * num_threads)                             \
+    reduction(+ : before, after, survivors) reduction(max : slowest)
+  {
+    int id = omp_get_thread_num();
+    InitThread(id);
+    if (id < num_threads) {
+      for (int j = 0; j < num_elems / num_threads; j++)
+        Add(&val);
+      int kept = 0;
+      for (block_t *block = threadBlock->next; block != NULL;
+           block = block->next)
+        for (int i = 0; i < block->capacity; i++) {
+          void *data = block->nodes[i];
+          if (data != NULL && kept++ % 16 != 0)
+            CAS(&block->nodes[i], &data, NULL);
+        }
+      before = listLength;
+      long start = NowNs();
+      if (compact)
+        Compact();
+      slowest = NowNs() - start;
+      after = listLength;
+      for (block_t *block = threadBlock; block != NULL; block = block->next)
+        for (int i = 0; i < block->capacity; i++)
+          survivors += block->nodes[i] != NULL;
+    }
+#pragma omp barrier
+#pragma omp master
+    tic = omp_get_wtime();
+    if (id >= num_threads) {
+      stealIndex = id - num_threads;
+      while (TryRemoveAny() != NULL)
+        ;
+    }
 #pragma omp barrier
+#pragma omp master
+    toc = omp_get_wtime();
+  }
+
+  result.time = toc - tic;
+  result.num_items = survivors;
+  result.blocks_before = before;
+  result.blocks_after = after;
+  result.compact_ns = compact ? slowest : 0;
+  result.steal_ns = survivors > 0 ? (toc - tic) * 1e9 / survivors : 0;
+  return result;
+}
+
+// Lane of item j in benchmark_lanes: 1 in 64 items goes to lane 3, 3 in 64
+// to lane 2, 12 in 64 to lane 1 and the rest to lane 0
+static int BenchLane(long j) {
+  return j % 64 == 0 ? 3 : j % 16 == 0 ? 2 : j % 4 == 0 ? 1 : 0;
+}
+
+struct lanes_result benchmark_lanes(int num_threads, int num_elems,
+                                    int use_lanes) {
+  // The first half of the threads add their share of the items and then
+  // help removing, the others remove until all items are gone; a single
+  // thread alternates. Items are the times of their Add. Without use_lanes
+  // all items go to lane 0 and keep their lane only as a label, as if
+  // urgent and bulk work shared one bag.
+  struct lanes_result result = {0};
+  long *stamp = malloc(sizeof(long) * num_elems);
+  long *latency[NUM_LANES];
+  long _Atomic count[NUM_LANES] = {0};
+  long _Atomic removed = 0;
+  int producers = num_threads > 1 ? num_threads / 2 : 1;
+  double tic, toc;
+
+  for (int l = 0; l < NUM_LANES; l++) {
+    latency[l] = malloc(sizeof(long) * num_elems);
+    if (latency[l] == NULL)
+      stamp = NULL;
+  }
+  if (stamp == NULL) {
+    fprintf(stderr, "lanes: cannot allocate %d samples\n", num_elems);
+    exit(EXIT_FAILURE);
+  }
+
+  omp_set_num_threads(num_threads);
+  InitBag(num_threads);
 
 #pragma omp parallel for
   for (int i = 0; i < num_threads; i++) {
-    if (omp_get_thread_num() != 0) {
-      int val = omp_get_thread_num();
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
-        Add(&val);
-      }
+    InitThread(omp_get_thread_num());
+  }
 
-    } else {
-      for (int j = 0; j < (int)(num_elems / num_threads); j++) {
-        int *res = (int *)(TryRemoveAny());
+  tic = omp_get_wtime();
+#pragma omp parallel num_threads(num_threads)
+  {
+    int id = omp_get_thread_num();
+    long first = (long)num_elems * id / producers;
+    long last = id < producers ? (long)num_elems * (id + 1) / producers : 0;
+    for (long j = first; LOAD(&removed) < num_elems;) {
+      if (j < last) {
+        stamp[j] = NowNs();
+        AddPri(&stamp[j], use_lanes ? BenchLane(j) : 0);
+        j++;
+        if (num_threads > 1)
+          continue;
+      }
+      long *item = TryRemoveAny();
+      if (item != NULL) {
+        int lane = BenchLane(item - stamp);
+        latency[lane][atomic_fetch_add(&count[lane], 1)] = NowNs() - *item;
+        atomic_fetch_add(&removed, 1);
       }
     }
   }
-
   toc = omp_get_wtime();
 
-  int cassuc, casfail, steal = 0;
-#pragma omp parallel for reduction(+ : cassuc, casfail, steal)
-  for (int i = 0; i < num_threads; i++) {
-    cassuc += numCASSuccess;
-    casfail += numCASFail;
-    steal += numSteal;
-  }
-  result.num_CASSuccess = cassuc;
-  result.num_CASFail = casfail;
-  result.num_Steal = steal;
   result.time = toc - tic;
-  result.num_items = num_threads * (int)(num_elems / num_threads);
+  result.num_items = num_elems;
+  for (int l = 0; l < NUM_LANES; l++) {
+    long n = count[l];
+    qsort(latency[l], n, sizeof(long), CompareLong);
+    result.num[l] = n;
+    if (n > 0) {
+      result.p50_ns[l] = latency[l][n / 2];
+      result.p99_ns[l] = latency[l][n * 99 / 100];
+      result.p999_ns[l] = latency[l][n * 999 / 1000];
+    }
+    free(latency[l]);
+  }
+  free(stamp);
   return result;
 }
 
@@ -550,11 +2994,96 @@ void UT_stealing(int num_threads) {
   printf("Unit test took %lf seconds \r\n", toc - tic);
 }
 
+// Turns on the optional paths named by mode for validate: sharing,
+// elimination, compaction, arena, cold or all of them. Returns false for
+// an unknown mode.
+static bool ValidateMode(const char *mode) {
+  bool all = strcmp(mode, "all") == 0;
+  bool known = all || strcmp(mode, "default") == 0;
+  // All other modes run with the summary on. Without it every empty verdict
+  // of this skewed workload rescans all drained blocks, and 3e6 ops at 8
+  // threads take 80 s instead of 0.3 s.
+  if (strcmp(mode, "default") != 0)
+    SetSummary(1);
+  if (all || strcmp(mode, "sharing") == 0) {
+    SetWorkSharing(2);
+    known = true;
+  }
+  if (all || strcmp(mode, "elimination") == 0) {
+    SetElimination(8);
+    known = true;
+  }
+  if (all || strcmp(mode, "compaction") == 0) {
+    SetCompaction(4);
+    validateEmpty = true;
+    known = true;
+  }
+  if (all || strcmp(mode, "arena") == 0) {
+    SetArena(1);
+    known = true;
+  }
+  if (all || strcmp(mode, "cold") == 0) {
+    SetStealMode(STEAL_COLD);
+    known = true;
+  }
+  if (all || strcmp(mode, "summary") == 0) {
+    SetSummary(1);
+    known = true;
+  }
+  if (all || strcmp(mode, "domains") == 0) {
+    SetStealDomains(8);
+    known = true;
+  }
+  return known;
+}
+
 int main(int argc, char *argv[]) {
-  double tic, toc;
   int threads;
-  int num_threads;
-  int num_elems = 100;
+  if (argc >= 2 && strcmp(argv[1], "validate") == 0) {
+    threads = argc >= 3 ? (int)strtol(argv[2], NULL, 10) : 4;
+    long ops = argc >= 4 ? strtol(argv[3], NULL, 10) : 1000000;
+    const char *mode = argc >= 5 ? argv[4] : "default";
+    if (threads < 1 || threads > MAX_NR_THREADS) {
+      fprintf(stderr, "validate: threads must be 1 to %d\n", MAX_NR_THREADS);
+      return EXIT_FAILURE;
+    }
+    if (getenv("YIELD")) SetYieldOnEmpty(1);
+    if (!ValidateMode(mode)) {
+      fprintf(stderr, "validate: unknown mode %s\n", mode);
+      return EXIT_FAILURE;
+    }
+    struct validate_result res = benchmark_validate(threads, ops);
+    printf("Validated %ld ops with %d threads (%s) in %f s: %ld added, %ld "
+           "removed, %ld lost, %ld duplicated",
+           res.num_ops, threads, mode, res.time, res.num_added,
+           res.num_removed, res.num_lost, res.num_duplicated);
+    if (validateEmpty)
+      printf(", %ld false empty", res.num_false_empty);
+    printf("\r\n");
+    if (res.num_lost != 0 || res.num_duplicated != 0 ||
+        res.num_false_empty != 0) {
+      fprintf(stderr,
+              "VALIDATION FAILED: %ld lost, %ld duplicated, %ld false empty\n",
+              res.num_lost, res.num_duplicated, res.num_false_empty);
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "micro") == 0) {
+    static const char *name[NUM_MICRO] = {
+        "add",        "add_new_block", "remove", "retire",
+        "steal_warm", "steal_cold",    "empty"};
+    int samples = argc >= 4 ? (int)strtol(argv[3], NULL, 10) : 10000;
+    threads = argc >= 3 ? (int)strtol(argv[2], NULL, 10) : 1;
+    struct micro_result res = benchmark_micro(threads, samples);
+    printf("%d threads, timer overhead %ld cycles\r\n", threads, res.overhead);
+    for (int m = 0; m < NUM_MICRO; m++)
+      printf("%-14s %8ld cycles %8ld samples\r\n", name[m], res.cycles[m],
+             res.samples[m]);
+    return EXIT_SUCCESS;
+  }
+
   if (argc == 2) {
     threads = (int)strtol(argv[1], NULL, 10);
   } else
@@ -8,8 +8,63 @@ void InitThread(int id);
 
 
 void Add(void *item);
+//Adds item to priority lane lane, from 0 (same as Add) to NUM_LANES - 1 in
+//config.h. TryRemoveAny takes items of higher lanes first.
+void AddPri(void *item, int lane);
 void *TryRemoveAny();
 
+// A consumer blocked in RemoveOrWait
+struct bag_waiter {
+  struct bag_waiter *next;
+  void *item; // Set to the handed over item before resume is called
+  int state;  // Claim word of the bag, set by RemoveOrWait
+  // Called by the thread whose Add woke the waiter. Should not block:
+  // normally it posts the consumer's continuation to its executor.
+  void (*resume)(struct bag_waiter *waiter);
+};
+//Removes an item, or registers waiter and returns NULL if the bag is empty.
+//A later Add then hands waiter an item and calls its resume.
+void *RemoveOrWait(struct bag_waiter *waiter);
+//Readiness file descriptor (an eventfd) for epoll, created on the first call.
+//It turns readable when an Add finds it armed and is rearmed by the
+//TryRemoveAny that finds the bag empty, so drain the bag until NULL after
+//every wake-up, and once after the first call.
+int BagEventFd();
+
+//Has to be called by each thread to give back memory of its drained blocks
+void Trim();
+//Trim automatically while adding and removing
+void SetAutoTrim(int enable);
+//Has to be called by the owner: move the items of sparse blocks into dense
+//ones and give the emptied blocks back
+void Compact();
+//Compact automatically every blocks new blocks of a longer list (0: off)
+void SetCompaction(int blocks);
+//Bytes of drained blocks each thread keeps for reuse
+void SetPoolHighWater(long bytes);
+//Carve blocks from per-thread huge-page chunks instead of malloc
+void SetArena(int enable);
+//Steal from the newest (0, default) or the oldest (1) block of a victim
+void SetStealMode(int mode);
+//Wait before retries: none (0, default), exponential (1) or adaptive (2)
+void SetBackoffPolicy(int policy);
+//Yield the core between empty steal rounds instead of backing off (0/1)
+void SetYieldOnEmpty(int yield);
+//Direct steals and detect empty bags with a per-thread summary (default off)
+void SetSummary(int enable);
+//Group threads into steal domains of threads threads, at most 64, which
+//steal from each other first (0, default: threads per last level cache).
+//Takes effect at the next InitBag.
+void SetStealDomains(int threads);
+//Hand whole blocks to idle threads once a list is longer than threshold
+//blocks (0, default: off)
+void SetWorkSharing(int threshold);
+//Let consumers with an empty list wait in one of slots elimination slots
+//for a concurrent Add to hand over its item (0, default: off)
+void SetElimination(int slots);
+//Let the owner remove from its own blocks without CAS (default on)
+void SetOwnerFastPath(int enable);
+
 block_t* NewNode(int);
 
 void DeleteNode(block_t *node);
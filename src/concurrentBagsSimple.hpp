@@ -0,0 +1,78 @@
+// C++20 coroutine interface of the simple bag (g++ -std=c++20).
+//
+//   void *item = co_await bag.remove(executor);
+//
+// completes at once if the bag holds an item and otherwise suspends the
+// coroutine until an Add hands it one. The coroutine is then resumed
+// through executor.execute(handle), called on the adding thread. Like
+// every bag operation, remove must run on a thread that called
+// InitThread, so executors should resume on such threads.
+#pragma once
+
+#include <coroutine>
+
+extern "C" {
+#include "concurrentBagsSimple.h"
+}
+
+namespace bag {
+
+// Resumes the consumer right inside the Add that woke it: on the adding
+// thread and on top of its stack, before Add returns. The consumer runs
+// with that thread's bag state, and a consumer that adds in turn nests
+// another Add, so this only suits consumers that do little per item. An
+// event loop should pass an executor that posts the handle to its ready
+// queue instead, like the one in awaitBench.cpp.
+struct InlineExecutor {
+  void execute(std::coroutine_handle<> handle) const { handle.resume(); }
+};
+
+template <class Executor> class RemoveAwaiter : private bag_waiter {
+public:
+  explicit RemoveAwaiter(Executor executor) : executor_(executor) {
+    next = nullptr;
+    item = nullptr;
+    state = 0;
+    resume = &RemoveAwaiter::Resume;
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    void *got = RemoveOrWait(this);
+    // Once registered an Add may resume, and destroy, us at any time
+    if (got == nullptr)
+      return true;
+    item = got;
+    return false;
+  }
+
+  void *await_resume() const noexcept { return item; }
+
+private:
+  static void Resume(bag_waiter *waiter) {
+    auto *self = static_cast<RemoveAwaiter *>(waiter);
+    self->executor_.execute(self->handle_);
+  }
+
+  Executor executor_;
+  std::coroutine_handle<> handle_;
+};
+
+// Handle on the bag, which is a global of the library
+struct Bag {
+  static void init(int num_threads) { InitBag(num_threads); }
+  static void init_thread(int id) { InitThread(id); }
+
+  void add(void *item) { Add(item); }
+  void add(void *item, int lane) { AddPri(item, lane); }
+  void *try_remove() { return TryRemoveAny(); }
+
+  template <class Executor = InlineExecutor>
+  RemoveAwaiter<Executor> remove(Executor executor = Executor()) {
+    return RemoveAwaiter<Executor>(executor);
+  }
+};
+
+} // namespace bag
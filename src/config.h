@@ -1,10 +1,15 @@
 /*
 Define some constants required for Code in the paper
 */
-#define MAX_BLOCK_SIZE 32
-#define MAX_NR_THREADS 64
+// Blocks start at MIN_BLOCK_SIZE slots and double up to MAX_BLOCK_SIZE
+#define MIN_BLOCK_SIZE 8
+#define MAX_BLOCK_SIZE 1024
+#define MAX_NR_THREADS 256
+// Priority lanes of the simple bag, lane 0 holds the ordinary items
+#define NUM_LANES 4
 
-#define WORD_SIZE sizeof(int)
+// Thread bits per notifyAdd word
+#define WORD_SIZE (8 * sizeof(long))
 
 // Memory model (Sequential Consistency?)
 #define SC
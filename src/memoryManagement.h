@@ -1,4 +1,4 @@
-block_t* _Atomic NewNode(void);
+block_t *NewNode(void);
 
 void DeleteNode(block_t *node);
 
@@ -1,4 +1,6 @@
+#include "bench.h"
 #include "config.h"
+#include "workload.h"
 
 #include <omp.h>
 #include <stdatomic.h> // gcc -latomic
@@ -13,14 +15,6 @@ struct simple_node {
   struct simple_node *next;
 };
 
-struct bench_result {
-  float time;
-  int num_items;
-  int cassuc;
-  int casfail;
-  int steal;
-};
-
 struct simple_node *tail;
 struct simple_node *head;
 
@@ -56,6 +50,7 @@ void *deq() {
 
 struct bench_result benchmark_random(int num_threads, int num_elems) {
   struct bench_result result;
+  struct thread_counters counters[MAX_NR_THREADS];
   double tic, toc;
 
   omp_set_num_threads(num_threads);
@@ -63,23 +58,56 @@ struct bench_result benchmark_random(int num_threads, int num_elems) {
   srand(1);
   result.num_items = num_elems;
   tic = omp_get_wtime();
-#pragma omp parallel for
-  for (int i = 0; i < num_elems; i++) {
-    if ((float)rand() / (float)(RAND_MAX) < 0.5) {
-      enq(&i);
-    } else {
-      int *res = (int *)(deq());
+#pragma omp parallel
+  {
+    struct thread_counters c = {.dtlb_misses = -1, .cache_misses = -1};
+    long start = ThreadCpuNs();
+    c.last_remove_ticks = ClockTicks();
+#pragma omp for
+    for (int i = 0; i < num_elems; i++) {
+      if ((float)rand() / (float)(RAND_MAX) < 0.5) {
+        enq(&i);
+        c.adds++;
+      } else {
+        uint64_t before = ClockTicks();
+        if (deq() != NULL) {
+          c.removes++;
+          if (before - c.last_remove_ticks > c.max_remove_gap)
+            c.max_remove_gap = before - c.last_remove_ticks;
+          c.last_remove_ticks = ClockTicks();
+        } else {
+          c.nulls++;
+          c.empty_ticks += ClockTicks() - before;
+        }
+      }
     }
+    c.cpu_ns = ThreadCpuNs() - start;
+    c.block_bytes = c.adds * sizeof(struct simple_node);
+    counters[omp_get_thread_num()] = c;
   }
   toc = omp_get_wtime();
 
-  result.cassuc = 0;
-  result.casfail = 0;
-  result.steal = 0;
+  FillCounters(&result, counters, num_threads);
   result.time = toc-tic;
   return result;
 }
 
+static void QueueInit(int num_threads) {
+  (void)num_threads;
+  init_queue();
+}
+
+static void QueueInitThread(int id) { (void)id; }
+
+static void QueueAdd(void *item) { enq(item); }
+
+// Runs a phased workload (see workload.h) against the queue
+void benchmark_workload(int num_threads, const struct workload_phase *phases,
+                        int num_phases, struct workload_result *result) {
+  const struct bag_ops bag = {QueueInit, QueueInitThread, QueueAdd, deq};
+  RunWorkload(&bag, num_threads, phases, num_phases, result);
+}
+
 int main(int argc, char *argv[]) {
   int Nr_threads = 3;
   if (argc == 2) {
@@ -0,0 +1,397 @@
+#include "sharedBag.h"
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARED_MAGIC 0x6261672d73686d31ull // "bag-shm1"
+#define SHARED_BLOCK_SIZE 256
+// Set in the next offset of a block its owner has unlinked
+#define MARK 1ull
+#define OFFSET(_link) ((_link) & ~MARK)
+// Blocks a thief walks in one victim's list before it moves on
+#define MAX_STEAL_STEPS 64
+
+struct shared_block {
+  uint64_t _Atomic next; // Offset of the next older block, or 0
+  uint64_t freeNext;     // Next block in the owner's free list
+  uint64_t _Atomic nodes[SHARED_BLOCK_SIZE]; // Items, 0 if empty
+};
+
+struct shared_header {
+  uint64_t magic;
+  uint64_t size;
+  uint64_t _Atomic bump;  // Offset of the first byte no block uses yet
+  int _Atomic participants;
+  // Newest block of each participant's list
+  _Alignas(64) uint64_t _Atomic head[MAX_NR_THREADS];
+  // Drained blocks of each participant, reused by that participant only.
+  // Blocks are never given back, so a thief that still looks at a reused
+  // block only ever sees slots of a block.
+  uint64_t freeBlocks[MAX_NR_THREADS];
+};
+
+// Mapping of this process
+struct shared_header *shm;
+// Thread-local storage
+int shmID = -1;
+uint64_t shmBlock; // Own newest block
+int shmHead;       // Slot the next SharedAdd uses in shmBlock
+int shmStealIndex;
+// Where the last steal from shmStealIndex stopped, 0 to start at its head
+uint64_t shmStealBlock;
+int shmStealSlot;
+
+#pragma omp threadprivate(shmID, shmBlock, shmHead, shmStealIndex,            \
+                          shmStealBlock, shmStealSlot)
+
+static inline struct shared_block *At(uint64_t offset) {
+  return (struct shared_block *)((char *)shm + offset);
+}
+
+bool SharedBagOpen(const char *name, size_t size, bool create) {
+  int fd = shm_open(name, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+  if (fd < 0)
+    return false;
+  if (create && ftruncate(fd, size) != 0) {
+    close(fd);
+    return false;
+  }
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+  shm = base;
+  if (create) {
+    // ftruncate zeroed the segment
+    shm->size = size;
+    shm->bump = (sizeof(struct shared_header) + 63) & ~63ul;
+    shm->magic = SHARED_MAGIC;
+  } else if (shm->magic != SHARED_MAGIC || shm->size != size) {
+    munmap(base, size);
+    shm = NULL;
+    return false;
+  }
+  return true;
+}
+
+void SharedBagClose() {
+  if (shm != NULL)
+    munmap(shm, shm->size);
+  shm = NULL;
+}
+
+void SharedBagUnlink(const char *name) { shm_unlink(name); }
+
+int SharedRegister() {
+  int id = atomic_fetch_add(&shm->participants, 1);
+  if (id >= MAX_NR_THREADS)
+    return -1;
+  shmID = id;
+  shmBlock = 0;
+  shmHead = SHARED_BLOCK_SIZE;
+  shmStealIndex = id;
+  shmStealBlock = 0;
+  return id;
+}
+
+// Links a drained or fresh block in front of the own list
+static void NewSharedBlock() {
+  uint64_t offset = shm->freeBlocks[shmID];
+  if (offset != 0)
+    shm->freeBlocks[shmID] = At(offset)->freeNext;
+  else {
+    offset = atomic_fetch_add(&shm->bump, sizeof(struct shared_block));
+    if (offset + sizeof(struct shared_block) > shm->size) {
+      fprintf(stderr, "shared bag: segment of %lu bytes is full\n",
+              (unsigned long)shm->size);
+      exit(EXIT_FAILURE);
+    }
+  }
+  atomic_store(&At(offset)->next, shmBlock);
+  atomic_store(&shm->head[shmID], offset);
+  shmBlock = offset;
+  shmHead = 0;
+}
+
+void SharedAdd(uint64_t item) {
+  if (shmBlock == 0 || shmHead == SHARED_BLOCK_SIZE)
+    NewSharedBlock();
+  atomic_store_explicit(&At(shmBlock)->nodes[shmHead++], item,
+                        memory_order_release);
+}
+
+// Thieves walk a victim's list from its newest block and keep their place
+// between calls, since the blocks of a participant that stopped removing
+// are never unlinked. A marked block was unlinked under the thief, which
+// then starts over at the current head. Returns 0 at the end of the list
+// or after MAX_STEAL_STEPS blocks.
+static uint64_t SharedSteal(int victim) {
+  uint64_t offset = shmStealBlock;
+  int slot = shmStealSlot;
+  if (offset == 0) {
+    offset = atomic_load(&shm->head[victim]);
+    slot = 0;
+  }
+  for (int steps = 0; offset != 0 && steps < MAX_STEAL_STEPS; steps++) {
+    struct shared_block *block = At(offset);
+    for (; slot < SHARED_BLOCK_SIZE; slot++) {
+      uint64_t item = atomic_load_explicit(&block->nodes[slot],
+                                           memory_order_acquire);
+      if (item != 0 && atomic_compare_exchange_strong(&block->nodes[slot],
+                                                      &item, 0)) {
+        shmStealBlock = offset;
+        shmStealSlot = slot;
+        return item;
+      }
+    }
+    uint64_t next = atomic_load(&block->next);
+    offset = next & MARK ? atomic_load(&shm->head[victim]) : OFFSET(next);
+    slot = 0;
+  }
+  shmStealBlock = offset;
+  shmStealSlot = 0;
+  return 0;
+}
+
+uint64_t SharedTryRemoveAny() {
+  for (;;) {
+    if (shmBlock == 0)
+      break;
+    struct shared_block *block = At(shmBlock);
+    while (shmHead > 0) {
+      int head = shmHead - 1;
+      uint64_t item = atomic_load_explicit(&block->nodes[head],
+                                           memory_order_acquire);
+      if (item != 0 &&
+          atomic_compare_exchange_strong(&block->nodes[head], &item, 0)) {
+        shmHead = head;
+        return item;
+      }
+      shmHead = head;
+    }
+    uint64_t next = atomic_load(&block->next);
+    if (next == 0)
+      break;
+    // Drained and only the owner adds: mark, unlink and keep it for reuse
+    atomic_fetch_or(&block->next, MARK);
+    atomic_store(&shm->head[shmID], next);
+    block->freeNext = shm->freeBlocks[shmID];
+    shm->freeBlocks[shmID] = shmBlock;
+    shmBlock = next;
+    shmHead = SHARED_BLOCK_SIZE;
+  }
+  int participants = atomic_load(&shm->participants);
+  if (participants > MAX_NR_THREADS)
+    participants = MAX_NR_THREADS;
+  for (int i = 0; i <= participants; i++) {
+    if (shmStealIndex != shmID) {
+      uint64_t item = SharedSteal(shmStealIndex);
+      if (item != 0)
+        return item;
+      if (shmStealBlock != 0)
+        continue; // Not at the end of this list yet
+    }
+    shmStealIndex = (shmStealIndex + 1) % participants;
+    shmStealBlock = 0;
+  }
+  return 0;
+}
+
+// Benchmarks
+
+struct shared_result {
+  float time;      // Bag in a shared segment, -1 if the run could not be set up
+  int num_items;
+  float pipe_time; // The same items sent through a pipe
+  long num_lost;
+  long num_duplicated;
+  long num_empty; // SharedTryRemoveAny calls that returned 0
+};
+
+// Counters of all processes of a run
+struct shared_counts {
+  long _Atomic removed, duplicated, empty;
+  int _Atomic producersDone;
+  uint64_t _Atomic seen[]; // Bit per item
+};
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Marks item in the bitmap. An item delivered before, or one that was never
+// added, counts as duplicated.
+static void MarkItem(struct shared_counts *counts, long num_elems,
+                     uint64_t item) {
+  uint64_t bit = 1ull << ((item - 1) % 64);
+  if (item > (uint64_t)num_elems ||
+      atomic_fetch_or(&counts->seen[(item - 1) / 64], bit) & bit)
+    atomic_fetch_add(&counts->duplicated, 1);
+  atomic_fetch_add(&counts->removed, 1);
+}
+
+// Waits for the processes forked so far, returns false if one failed
+static bool WaitAll(int processes) {
+  bool ok = true;
+  for (int i = 0; i < processes; i++) {
+    int status;
+    if (wait(&status) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+      ok = false;
+  }
+  return ok;
+}
+
+// Consumer of benchmark_shared: removes until all items are delivered, or
+// until all producers are done and limit calls in a row found nothing.
+// SharedTryRemoveAny walks a bounded part of the lists per call and keeps
+// its place, so limit covers a walk over every block of the segment.
+static void Consume(struct shared_counts *counts, long num_elems,
+                    int producers, long limit) {
+  long misses = 0;
+  while (atomic_load(&counts->removed) < num_elems && misses < limit) {
+    uint64_t item = SharedTryRemoveAny();
+    if (item != 0) {
+      MarkItem(counts, num_elems, item);
+      misses = 0;
+    } else {
+      atomic_fetch_add(&counts->empty, 1);
+      if (atomic_load(&counts->producersDone) == producers)
+        misses++;
+    }
+  }
+}
+
+struct shared_result benchmark_shared(int num_threads, int num_elems) {
+  // num_threads processes, half of them producers and at least one of
+  // each. Consumers attach to the segment on their own, so it is mapped
+  // at another address than in the producers. The baseline writes and
+  // reads every item through a pipe instead.
+  struct shared_result result = {0};
+  int producers = num_threads > 1 ? (num_threads + 1) / 2 : 1;
+  int consumers = num_threads > 1 ? num_threads - producers : 1;
+  long words = num_elems / 64 + 1;
+  size_t counts_size = sizeof(struct shared_counts) + words * sizeof(uint64_t);
+  size_t size = 2 * (num_elems / SHARED_BLOCK_SIZE + 2 * MAX_NR_THREADS) *
+                    sizeof(struct shared_block) +
+                sizeof(struct shared_header);
+  char name[64];
+  double tic;
+
+  int forked = 0;
+  bool ok;
+  result.time = -1;
+
+  struct shared_counts *counts = mmap(NULL, counts_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (counts == MAP_FAILED) {
+    perror("shared bag: counters");
+    return result;
+  }
+  snprintf(name, sizeof(name), "/concurrentBagsShared.%d", (int)getpid());
+  SharedBagUnlink(name);
+  if (!SharedBagOpen(name, size, true)) {
+    fprintf(stderr, "shared bag: cannot create segment %s\n", name);
+    munmap(counts, counts_size);
+    return result;
+  }
+
+  tic = Now();
+  for (int p = 0; p < producers + consumers; p++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("shared bag: fork");
+      // Let the consumers already running stop once the bag is drained
+      if (p < producers)
+        atomic_fetch_add(&counts->producersDone, producers - p);
+      break;
+    }
+    forked++;
+    if (pid != 0)
+      continue;
+    if (p < producers) {
+      SharedRegister();
+      for (long i = num_elems * p / producers;
+           i < num_elems * (p + 1) / producers; i++)
+        SharedAdd(i + 1);
+      atomic_fetch_add(&counts->producersDone, 1);
+    } else {
+      SharedBagClose();
+      if (!SharedBagOpen(name, size, false))
+        _exit(EXIT_FAILURE);
+      SharedRegister();
+      Consume(counts, num_elems, producers,
+              size / sizeof(struct shared_block) + MAX_NR_THREADS);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  ok = WaitAll(forked) && forked == producers + consumers;
+  result.time = Now() - tic;
+  SharedBagClose();
+  SharedBagUnlink(name);
+  if (!ok) {
+    fprintf(stderr, "shared bag: a process could not run\n");
+    munmap(counts, counts_size);
+    result.time = -1;
+    return result;
+  }
+
+  long delivered = 0;
+  for (long w = 0; w < words; w++)
+    delivered += __builtin_popcountll(counts->seen[w]);
+  result.num_items = num_elems;
+  result.num_lost = num_elems - delivered;
+  result.num_duplicated = counts->duplicated;
+  result.num_empty = counts->empty;
+
+  int pipefd[2];
+  if (pipe(pipefd) != 0) {
+    perror("pipe");
+    result.pipe_time = -1;
+    munmap(counts, counts_size);
+    return result;
+  }
+  forked = 0;
+  tic = Now();
+  for (int p = 0; p < producers + consumers; p++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("pipe baseline: fork");
+      break;
+    }
+    forked++;
+    if (pid != 0)
+      continue;
+    if (p < producers) {
+      close(pipefd[0]);
+      for (long i = num_elems * p / producers;
+           i < num_elems * (p + 1) / producers; i++) {
+        uint64_t item = i + 1;
+        if (write(pipefd[1], &item, sizeof(item)) != sizeof(item))
+          _exit(EXIT_FAILURE);
+      }
+    } else {
+      uint64_t item;
+      close(pipefd[1]);
+      while (read(pipefd[0], &item, sizeof(item)) == sizeof(item))
+        ;
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  close(pipefd[0]);
+  close(pipefd[1]);
+  ok = WaitAll(forked) && forked == producers + consumers;
+  result.pipe_time = ok ? Now() - tic : -1;
+
+  munmap(counts, counts_size);
+  return result;
+}
@@ -0,0 +1,29 @@
+// Bag in a POSIX shared memory segment, for producers and consumers in
+// different processes. Every participant (a thread of any process that
+// mapped the segment) owns a list of blocks in the segment. Blocks are
+// addressed by offsets, so every process may map the segment at another
+// address, and the low bit of a next offset marks a block its owner has
+// unlinked. Items are nonzero 64-bit values, e.g. offsets of payloads in
+// another shared segment, since pointers mean nothing to other processes.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Creates (create) or attaches to the segment called name, of size bytes,
+// and maps it into this process. Returns false if that fails.
+bool SharedBagOpen(const char *name, size_t size, bool create);
+// Unmaps the segment from this process
+void SharedBagClose();
+// Removes the name of the segment, existing mappings stay valid
+void SharedBagUnlink(const char *name);
+// Has to be called by each participating thread, after SharedBagOpen.
+// Returns the participant id, or -1 if MAX_NR_THREADS have registered.
+int SharedRegister();
+
+void SharedAdd(uint64_t item);
+// Returns an item, or 0 if a bounded walk over the lists found none.
+// Unlike the NULL of TryRemoveAny this does not prove the bag was empty:
+// there is no notify protocol, so 0 may come back while other participants
+// still hold items. The walk resumes where it stopped, so a caller that
+// needs every item calls again until it knows no more can come.
+uint64_t SharedTryRemoveAny();
@@ -0,0 +1,78 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct trace_ring traceRing[MAX_NR_THREADS];
+
+#ifdef TRACE
+static const char *traceName[NUM_TRACE_EVENTS] = {
+    "Add",         "TryRemoveAny",   "TryRemoveAny",   "TryStealBlock",
+    "Steal",       "NextStealBlock", "BlockLink",      "BlockUnlink"};
+
+void TraceReset(int tid) {
+  struct trace_ring *ring = &traceRing[tid];
+  if (ring->records == NULL) {
+    ring->records = malloc(sizeof(struct trace_record) * TRACE_RING_SIZE);
+    if (ring->records == NULL) {
+      fprintf(stderr, "trace: cannot allocate ring of thread %d\n", tid);
+      exit(EXIT_FAILURE);
+    }
+  }
+  ring->next = 0;
+}
+
+long TraceExport(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return -1;
+
+  // Timestamps start at the earliest record still in any ring
+  uint64_t start = UINT64_MAX;
+  for (int t = 0; t < MAX_NR_THREADS; t++) {
+    struct trace_ring *ring = &traceRing[t];
+    if (ring->records == NULL || ring->next == 0)
+      continue;
+    uint64_t first = ring->next > TRACE_RING_SIZE ? ring->next - TRACE_RING_SIZE : 0;
+    uint64_t tsc = ring->records[first & (TRACE_RING_SIZE - 1)].tsc;
+    if (tsc < start)
+      start = tsc;
+  }
+  double ticks_per_us = ClockTicksPerNs() * 1000;
+
+  long events = 0;
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (int t = 0; t < MAX_NR_THREADS; t++) {
+    struct trace_ring *ring = &traceRing[t];
+    if (ring->records == NULL)
+      continue;
+    uint64_t first = ring->next > TRACE_RING_SIZE ? ring->next - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < ring->next; i++) {
+      struct trace_record *r = &ring->records[i & (TRACE_RING_SIZE - 1)];
+      // TryRemoveAny becomes a slice on the timeline, everything else an
+      // instant event inside it
+      const char *phase = r->type == TRACE_REMOVE_BEGIN ? "B"
+                          : r->type == TRACE_REMOVE_END ? "E"
+                                                        : "i";
+      fprintf(out,
+              "%s{\"name\":\"%s\",\"ph\":\"%s\",\"s\":\"t\",\"ts\":%.3f,"
+              "\"pid\":0,\"tid\":%d,\"args\":{\"victim\":%d,\"block\":\"%p\","
+              "\"slot\":%ld}}\n",
+              events ? "," : "", traceName[r->type], phase,
+              (r->tsc - start) / ticks_per_us, t, r->victim, r->block,
+              (long)r->slot);
+      events++;
+    }
+  }
+  fprintf(out, "]}\n");
+  fclose(out);
+  return events;
+}
+#else
+void TraceReset(int tid) { (void)tid; }
+
+long TraceExport(const char *path) {
+  (void)path;
+  return -1;
+}
+#endif
@@ -0,0 +1,66 @@
+// Event tracer, compiled in with -DTRACE (make TRACE=1). Every thread
+// writes fixed-size records into its own ring buffer; TraceExport turns
+// them into a Chrome trace (chrome://tracing, ui.perfetto.dev) afterwards.
+#include "config.h"
+#include "workload.h"
+
+#include <stdint.h>
+
+// Records kept per thread, older ones are overwritten. Power of two.
+#define TRACE_RING_SIZE (1 << 16)
+
+enum {
+  TRACE_ADD,              // Item stored in block at slot
+  TRACE_REMOVE_BEGIN,     // TryRemoveAny entered
+  TRACE_REMOVE_END,       // ... left, slot is 0 own item, 1 stolen,
+                          // 2 handed over by elimination, 3 from a
+                          // priority lane, -1 empty
+  TRACE_STEAL_TRY,        // TryStealBlock on victim's block in round slot
+  TRACE_STEAL_HIT,        // Item stolen from victim's block at slot
+  TRACE_NEXT_STEAL_BLOCK, // Thief moved on to victim's block
+  TRACE_BLOCK_LINK,       // Owner linked a new block of slot capacity
+  TRACE_BLOCK_UNLINK,     // Owner unlinked a drained block
+  NUM_TRACE_EVENTS
+};
+
+struct trace_record {
+  uint64_t tsc;
+  int32_t type;
+  int32_t victim;
+  const void *block;
+  int64_t slot;
+};
+
+struct trace_ring {
+  struct trace_record *records;
+  uint64_t next;
+  char pad[64 - sizeof(struct trace_record *) - sizeof(uint64_t)];
+};
+
+extern struct trace_ring traceRing[MAX_NR_THREADS];
+
+static inline void TraceRecord(int tid, int type, int victim,
+                               const void *block, long slot) {
+  struct trace_ring *ring = &traceRing[tid];
+  struct trace_record *r = &ring->records[ring->next++ & (TRACE_RING_SIZE - 1)];
+  r->tsc = ClockTicks();
+  r->type = type;
+  r->victim = victim;
+  r->block = block;
+  r->slot = slot;
+}
+
+#ifdef TRACE
+#define TRACE_EVENT(_tid, _type, _victim, _block, _slot)                       \
+  TraceRecord(_tid, _type, _victim, _block, _slot)
+#define TRACE_RESET(_tid) TraceReset(_tid)
+#else
+#define TRACE_EVENT(_tid, _type, _victim, _block, _slot) ((void)0)
+#define TRACE_RESET(_tid) ((void)0)
+#endif
+
+// Empties the ring of thread tid, allocating it on first use
+void TraceReset(int tid);
+// Writes all rings as Chrome trace JSON. Returns the number of events
+// written, or -1 if the tracer is compiled out or path cannot be written.
+long TraceExport(const char *path);
@@ -0,0 +1,127 @@
+#include "workload.h"
+
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Stands in for the work a real producer or consumer does per item
+static void Payload(int iterations, uint64_t *state) {
+  for (int i = 0; i < iterations; i++) {
+    XorShift(state);
+    __asm__ volatile("" : : "r"(*state));
+  }
+}
+
+// Add probability of thread id so that the rates follow a Zipf
+// distribution over the threads and average to add_ratio.
+static float AddProbability(const struct workload_phase *phase, int id,
+                            int num_threads) {
+  if (phase->zipf_s == 0)
+    return phase->add_ratio;
+  double sum = 0;
+  for (int i = 0; i < num_threads; i++)
+    sum += pow(i + 1, -phase->zipf_s);
+  double p = phase->add_ratio * num_threads * pow(id + 1, -phase->zipf_s) / sum;
+  return p > 1 ? 1 : p;
+}
+
+void RunWorkload(const struct bag_ops *bag, int num_threads,
+                 const struct workload_phase *phases, int num_phases,
+                 struct workload_result *result) {
+  if (num_phases > MAX_PHASES)
+    num_phases = MAX_PHASES;
+  memset(result, 0, sizeof(*result));
+  result->num_phases = num_phases;
+
+  omp_set_num_threads(num_threads);
+  bag->init_bag(num_threads);
+
+#pragma omp parallel num_threads(num_threads)
+  {
+    int id = omp_get_thread_num();
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (id + 1);
+    int val = id;
+    bag->init_thread(id);
+
+    for (int p = 0; p < num_phases; p++) {
+      const struct workload_phase *phase = &phases[p];
+      uint32_t threshold =
+          AddProbability(phase, id, num_threads) * (double)UINT32_MAX;
+      int period = phase->burst_on + phase->burst_off;
+      long adds = 0, removes = 0, nulls = 0;
+      double tic = 0;
+
+#pragma omp barrier
+#pragma omp master
+      tic = omp_get_wtime();
+
+      for (int j = 0; j < phase->ops_per_thread; j++) {
+        if (phase->burst_on > 0 && j % period >= phase->burst_on) {
+          Payload(phase->payload, &rng);
+          continue;
+        }
+        if ((uint32_t)XorShift(&rng) < threshold) {
+          Payload(phase->payload, &rng);
+          bag->add(&val);
+          adds++;
+        } else if (bag->remove() != NULL) {
+          Payload(phase->payload, &rng);
+          removes++;
+        } else
+          nulls++;
+      }
+
+#pragma omp atomic
+      result->num_add[p] += adds;
+#pragma omp atomic
+      result->num_remove[p] += removes;
+#pragma omp atomic
+      result->num_null[p] += nulls;
+#pragma omp barrier
+#pragma omp master
+      result->time[p] = omp_get_wtime() - tic;
+    }
+  }
+}
+
+static long Ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+double ClockTicksPerNs() {
+  static double ticksPerNs;
+  if (ticksPerNs == 0) {
+    struct timespec pause = {0, 10000000};
+    long ns = Ns(CLOCK_MONOTONIC);
+    uint64_t ticks = ClockTicks();
+    nanosleep(&pause, NULL);
+    ticksPerNs = (double)(ClockTicks() - ticks) / (Ns(CLOCK_MONOTONIC) - ns);
+  }
+  return ticksPerNs;
+}
+
+long ThreadCpuNs() { return Ns(CLOCK_THREAD_CPUTIME_ID); }
+
+void Fairness(const long *counts, int n, double *jain, double *max_min) {
+  double sum = 0, squares = 0;
+  long most = 0, fewest = n > 0 ? counts[0] : 0;
+  for (int i = 0; i < n; i++) {
+    sum += counts[i];
+    squares += (double)counts[i] * counts[i];
+    if (counts[i] > most)
+      most = counts[i];
+    if (counts[i] < fewest)
+      fewest = counts[i];
+  }
+  if (sum == 0) {
+    *jain = NAN;
+    *max_min = NAN;
+    return;
+  }
+  *jain = sum * sum / (n * squares);
+  *max_min = fewest > 0 ? (double)most / fewest : INFINITY;
+}
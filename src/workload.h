@@ -0,0 +1,72 @@
+// Workload generator shared by the benchmark entry points of all bags.
+// A workload is a sequence of phases; threads synchronise between phases
+// and every phase is timed on its own. The clocks at the end serve the
+// other benchmarks of the bags as well.
+#pragma once
+
+#include <stdint.h>
+
+#define MAX_PHASES 8
+
+struct workload_phase {
+  int ops_per_thread; // Operations each thread issues in this phase
+  float add_ratio;    // Fraction of operations that are adds, on average
+  // Bursts: ops issued during burst_on, then burst_off operations spent on
+  // payload work only. burst_on == 0 disables bursts.
+  int burst_on;
+  int burst_off;
+  // Skew of the per-thread add rates: thread i adds with a rate
+  // proportional to 1 / (i + 1)^zipf_s. 0 gives every thread add_ratio.
+  float zipf_s;
+  int payload; // Iterations of dummy work per produced and consumed item
+};
+
+struct workload_result {
+  int num_phases;
+  float time[MAX_PHASES];
+  long num_add[MAX_PHASES];
+  long num_remove[MAX_PHASES]; // Successful removes only
+  long num_null[MAX_PHASES];   // Removes that found the bag empty
+};
+
+// Entry points of the bag under test
+struct bag_ops {
+  void (*init_bag)(int num_threads);
+  void (*init_thread)(int id);
+  void (*add)(void *item);
+  void *(*remove)(void);
+};
+
+void RunWorkload(const struct bag_ops *bag, int num_threads,
+                 const struct workload_phase *phases, int num_phases,
+                 struct workload_result *result);
+
+// Fast pseudo-random numbers for the workloads and the benchmarks
+static inline uint64_t XorShift(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+// Cycle counter for timing short intervals inside bag operations and for
+// the time stamps of the tracer
+static inline uint64_t ClockTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#endif
+}
+
+// ClockTicks per ns, measured against the wall clock on the first call
+double ClockTicksPerNs();
+// CPU time the calling thread has used so far, in ns
+long ThreadCpuNs();
+// Jain fairness index (sum x)^2 / (n * sum x^2) of the counts of n threads,
+// 1 if all are equal and 1/n if one thread has everything, and the largest
+// over the smallest count. Both are NAN if all counts are 0.
+void Fairness(const long *counts, int n, double *jain, double *max_min);